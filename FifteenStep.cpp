@@ -8,8 +8,299 @@
 // License: GNU GPLv3
 //
 // ---------------------------------------------------------------------------
-#include "Arduino.h"
 #include "FifteenStep.h"
+#include "FifteenStepJournal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            STREAM BUFFER                                  //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// FifteenStepBuffer
+//
+// Collects bytes into FS_CHUNK_SIZE chunks so the user
+// supplied read and write callbacks are called with small
+// blocks instead of once per byte.
+//
+struct FifteenStepBuffer
+{
+
+  WriteCallback write_cb;
+  ReadCallback  read_cb;
+  void*         context;
+  byte          data[FS_CHUNK_SIZE];
+  byte          length;
+  byte          index;
+  long          total;
+
+  // add a byte to the chunk, and send it
+  // to the callback once it is full. if there
+  // isn't a callback, the bytes are only counted
+  void put(byte value)
+  {
+
+    total++;
+
+    if(! write_cb)
+      return;
+
+    data[length++] = value;
+
+    if(length >= FS_CHUNK_SIZE)
+      flush();
+
+  }
+
+  // add a 16 bit big endian value
+  void putInt(unsigned int value)
+  {
+    put(value >> 8);
+    put(value & 0xFF);
+  }
+
+  // add a 32 bit big endian value
+  void putLong(unsigned long value)
+  {
+    putInt(value >> 16);
+    putInt(value & 0xFFFF);
+  }
+
+  // add a MIDI variable length quantity
+  void putVariable(unsigned long value)
+  {
+
+    byte bytes[4];
+    byte count = 0;
+
+    do {
+      bytes[count++] = value & 0x7F;
+      value >>= 7;
+    } while(value > 0 && count < 4);
+
+    // most significant group first, with the
+    // high bit set on all but the last byte
+    while(count > 0) {
+      count--;
+      put(bytes[count] | (count > 0 ? 0x80 : 0x0));
+    }
+
+  }
+
+  // send whatever is left in the chunk
+  void flush()
+  {
+
+    if(length > 0 && write_cb)
+      write_cb(context, data, length);
+
+    length = 0;
+
+  }
+
+  // grab the next byte, and refill the chunk
+  // from the callback when it runs out
+  bool get(byte &value)
+  {
+
+    if(index >= length) {
+
+      length = read_cb(context, data, FS_CHUNK_SIZE);
+      index = 0;
+
+      // no more data
+      if(length == 0)
+        return false;
+
+    }
+
+    value = data[index++];
+    total++;
+
+    return true;
+
+  }
+
+  // grab a 16 bit big endian value
+  bool getInt(unsigned int &value)
+  {
+
+    byte high, low;
+
+    if(! get(high) || ! get(low))
+      return false;
+
+    value = (high << 8) | low;
+
+    return true;
+
+  }
+
+  // grab a 32 bit big endian value
+  bool getLong(unsigned long &value)
+  {
+
+    unsigned int high, low;
+
+    if(! getInt(high) || ! getInt(low))
+      return false;
+
+    value = ((unsigned long) high << 16) | low;
+
+    return true;
+
+  }
+
+  // grab a MIDI variable length quantity
+  bool getVariable(unsigned long &value)
+  {
+
+    byte b;
+    value = 0;
+
+    for(byte i = 0; i < 4; ++i)
+    {
+
+      if(! get(b))
+        return false;
+
+      value = (value << 7) | (b & 0x7F);
+
+      if(! (b & 0x80))
+        return true;
+
+    }
+
+    return false;
+
+  }
+
+  // throw away bytes we don't need
+  bool skip(unsigned long count)
+  {
+
+    byte b;
+
+    while(count-- > 0)
+    {
+      if(! get(b))
+        return false;
+    }
+
+    return true;
+
+  }
+
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            SYSEX HELPERS                                  //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// FifteenStepSysEx
+//
+// Used by sendDump to collect serialized data into
+// FS_SYSEX_CHUNK byte groups, and by the SysEx loader to
+// read the received data back out of memory.
+//
+struct FifteenStepSysEx
+{
+  SysExCallback cb;
+  void*         context;
+  const byte*   data;
+  unsigned int  length;
+  unsigned int  position;
+  byte          chunk[FS_SYSEX_CHUNK];
+  byte          count;
+};
+
+// counts the serialized bytes before the dump is sent
+static void _sysexCount(void* context, const byte*, byte length)
+{
+  ((FifteenStepSysEx*) context)->length += length;
+}
+
+// packs FS_SYSEX_CHUNK raw bytes into one SysEx message.
+// the high bits of each byte are sent first in their own
+// byte, followed by the low seven bits of each byte.
+static void _sysexSend(FifteenStepSysEx* dump)
+{
+
+  byte message[FS_SYSEX_CHUNK + 11];
+  byte size = 0;
+  byte sum = 0;
+  unsigned int index = dump->position / FS_SYSEX_CHUNK;
+
+  message[size++] = 0xF0;
+  message[size++] = FS_SYSEX_ID;
+  message[size++] = 'F';
+  message[size++] = 0x01;
+  message[size++] = (index >> 7) & 0x7F;
+  message[size++] = index & 0x7F;
+  message[size++] = (dump->length >> 7) & 0x7F;
+  message[size++] = dump->length & 0x7F;
+
+  byte high = 0;
+
+  for(byte i = 0; i < dump->count; ++i)
+  {
+    if(dump->chunk[i] & 0x80)
+      high |= 1 << i;
+  }
+
+  message[size++] = high;
+  sum ^= high;
+
+  for(byte i = 0; i < dump->count; ++i)
+  {
+    message[size++] = dump->chunk[i] & 0x7F;
+    sum ^= dump->chunk[i] & 0x7F;
+  }
+
+  message[size++] = sum & 0x7F;
+  message[size++] = 0xF7;
+
+  dump->cb(dump->context, message, size);
+
+  dump->position += dump->count;
+  dump->count = 0;
+
+}
+
+// collects serialized bytes and sends a message
+// every time a full group has been collected
+static void _sysexWrite(void* context, const byte* data, byte length)
+{
+
+  FifteenStepSysEx* dump = (FifteenStepSysEx*) context;
+
+  for(byte i = 0; i < length; ++i)
+  {
+
+    dump->chunk[dump->count++] = data[i];
+
+    if(dump->count >= FS_SYSEX_CHUNK)
+      _sysexSend(dump);
+
+  }
+
+}
+
+// reads the received dump back out of memory
+static byte _sysexRead(void* context, byte* data, byte length)
+{
+
+  FifteenStepSysEx* dump = (FifteenStepSysEx*) context;
+  byte count = 0;
+
+  while(count < length && dump->position < dump->length)
+    data[count++] = dump->data[dump->position++];
+
+  return count;
+
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
@@ -44,6 +335,22 @@ FifteenStep::FifteenStep(int memory)
   _init(memory);
 }
 
+// ~FifteenStep
+//
+// Frees the memory reserved for the sequence. Since the
+// memory is owned by the sequencer, it can't be copied.
+//
+// @access public
+//
+FifteenStep::~FifteenStep()
+{
+  delete[] _sequence;
+  delete[] _trigs;
+  delete[] _locks;
+  delete[] _undo;
+  delete[] _sysex_buffer;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
 //                            PUBLIC METHODS                                 //
@@ -110,24 +417,54 @@ void FifteenStep::begin(int tempo, int steps)
 void FifteenStep::run()
 {
 
-  if(! _running)
-    return;
-
   // what's the time?
-  unsigned long now = millis();
+  unsigned long now = _now();
   // it's time to get ill.
 
+  // keep track of how often run() is called
+  if(_stats.runs > 0 && now - _last_run > _stats.max_gap)
+    _stats.max_gap = now - _last_run;
+
+  _stats.runs++;
+  _last_run = now;
+
+  if(! _running) {
+    // the next beat is stale until a step is played
+    _on_time = false;
+    return;
+  }
+
   // send clock
   if(now >= _next_clock) {
     _tick();
     _next_clock = now + _clock;
   }
 
+  // send anything scheduled in between steps
+  if(_queue_count > 0)
+    _runQueue(now);
+
   // only step if it's time
   if(now < _next_beat)
     return;
 
+  // count steps that were played after they were due
+  if(_on_time && now > _next_beat) {
+
+    unsigned long late = now - _next_beat;
+
+    _stats.late_steps++;
+    _stats.total_late += late;
+
+    if(late > _stats.max_late)
+      _stats.max_late = late;
+
+  }
+
   // advance and send notes
+  _last_beat = now;
+  _on_time = true;
+  _stats.steps++;
   _step();
 
   // add shuffle offset to next beat if needed
@@ -190,6 +527,10 @@ void FifteenStep::setTempo(int tempo)
 // back to the beginning. Increasing the step count will
 // decrease the amount of polyphony the sequencer supports.
 //
+// The step count is also the size of each stored pattern,
+// so changing it while more than one pattern is in use will
+// shift where the patterns start in the sequence.
+//
 // @access pubilc
 // @return void
 //
@@ -203,16 +544,44 @@ void FifteenStep::setSteps(int steps)
   if(_steps > FS_MAX_STEPS)
     _steps = FS_MAX_STEPS;
 
+  // patterns are stored as pages of steps, so the
+  // last usable step depends on how many are in use
+  int last = _steps * _patterns;
+
+  bool cleared = false;
+
+  // the sequence needs to be in order before it's cleared
+  if(_edit_count > 0)
+    _applyEdits();
+
   // loop through the sequence and clear notes past the current step
   for(int i=0; i < _sequence_size; ++i)
   {
 
     // reset any steps that are over the current step count
-    if(_sequence[i].step >= _steps)
+    if(_sequence[i].step >= last && ! _isEmpty(i)) {
+      _markDirty(_sequence[i].step);
       _sequence[i] = DEFAULT_NOTE;
+      cleared = true;
+    }
 
   }
 
+  // move the cleared slots back to the start
+  if(cleared)
+    _heapSort();
+
+  // remove trigs for the cleared notes
+  for(int i = _trig_count - 1; i >= 0; --i)
+  {
+    if(_trigs[i].step >= last)
+      _removeTrig(_trigs[i].channel, _trigs[i].pitch, _trigs[i].step);
+  }
+
+  // locks are in step order, so the cleared ones are at the end
+  while(_lock_count > 0 && _locks[_lock_count - 1].step >= last)
+    _lock_count--;
+
 }
 
 // increaseTempo
@@ -319,6 +688,27 @@ void FifteenStep::setMidiHandler(MIDIcallback cb)
 {
   // store the passed callback
   _midi_cb = cb;
+  _midi_context_cb = NULL;
+  _midi_context = NULL;
+}
+
+// setMidiHandler
+//
+// Allows user to set a MIDI callback that is also passed a
+// user data pointer, so the same callback can be used by
+// more than one sequencer or send to more than one output.
+// This replaces a callback set without a context.
+//
+// @access public
+// @param the midi callback that the sequencer will use
+// @param user data passed to the callback
+// @return void
+//
+void FifteenStep::setMidiHandler(MIDIContextCallback cb, void* context)
+{
+  _midi_cb = NULL;
+  _midi_context_cb = cb;
+  _midi_context = context;
 }
 
 // setStepHandler
@@ -338,303 +728,4724 @@ void FifteenStep::setStepHandler(StepCallback cb)
 {
   // store the passed callback
   _step_cb = cb;
+  _step_context_cb = NULL;
+  _step_context = NULL;
+}
+
+// setStepHandler
+//
+// Allows user to set a step callback that is also passed
+// a user data pointer. This replaces a callback set
+// without a context.
+//
+// @access public
+// @param the callback function to call when the progression advances
+// @param user data passed to the callback
+// @return void
+//
+void FifteenStep::setStepHandler(StepContextCallback cb, void* context)
+{
+  _step_cb = NULL;
+  _step_context_cb = cb;
+  _step_context = context;
+}
+
+// setClockSource
+//
+// Allows user to replace millis() with their own clock. This
+// is required when the sequencer is built on a host without
+// the Arduino core, and lets FifteenStepSimulator run the
+// sequencer on a virtual clock. Please check the typedef for
+// ClockCallback in FifteenStep.h for more info.
+//
+// @access public
+// @param the callback that returns the time in milliseconds
+// @param user data passed to the callback
+// @return void
+//
+void FifteenStep::setClockSource(ClockCallback cb, void* context)
+{
+  _clock_cb = cb;
+  _clock_context = context;
 }
 
 // setNote
 //
 // Allows user to set a note on or off value at the current
 // step position. If there is already a note on value at this
-// position, the note will be turned off.
+// position, the note will be turned off. The step is relative
+// to the start of the current pattern. The result tells you
+// if the note was stored, turned off, or dropped because the
+// sequence is full.
 //
 // @access public
 // @param note on or off message
 // @param pitch of note
 // @param velocity of note
 // @param position in sequence
-// @return void
+// @return byte - FS_NOTE_STORED, FS_NOTE_REMOVED, FS_NOTE_DROPPED, FS_NOTE_PENDING or FS_NOTE_IGNORED
 //
-void FifteenStep::setNote(byte channel, byte pitch, byte velocity, byte step)
+byte FifteenStep::setNote(byte channel, byte pitch, byte velocity, byte step)
 {
 
   // don't save notes if the sequencer isn't running
   if(! _running)
-    return;
+    return FS_NOTE_IGNORED;
 
   int position;
 
-  // this variable allows the loop to track when a note has been added,
-  // but also clears out existing matching notes
-  bool added = false;
-
-  if(step == -1)
-    position = _quantizedPosition();
+  // steps are relative to the current pattern
+  if(step == (byte) -1)
+    position = _offset() + _quantizedPosition();
   else
-    position = step;
+    position = _offset() + step;
 
-  for(int i = _sequence_size - 1; i >= 0; i--)
-  {
+  unsigned long start = _micros();
 
-    // used by another pitch, keep going
-    if(_sequence[i].pitch > 0 && _sequence[i].pitch != pitch)
-      continue;
+  byte result = _storeNote(channel, pitch, velocity, position);
 
-    // used by another step, keep going
-    if(_sequence[i].step != position && _sequence[i].pitch != 0)
-      continue;
+  unsigned long duration = _micros() - start;
 
-    // used by another channel, keep going
-    if(_sequence[i].channel != channel && _sequence[i].pitch != 0)
-      continue;
+  if(duration > _stats.max_set_note)
+    _stats.max_set_note = duration;
 
-    // matches the sent step, pitch & channel
-    if(_sequence[i].pitch == pitch && _sequence[i].step == position && _sequence[i].channel == channel)
-    {
+  return result;
 
-      if(velocity > 0 && _sequence[i].velocity > 0) {
-        _sequence[i] = DEFAULT_NOTE;
-        added = true;
-        continue;
-      } else if(velocity == 0 && _sequence[i].velocity == 0) {
-        _sequence[i] = DEFAULT_NOTE;
-        added = true;
-        continue;
-      }
+}
 
-    }
+// recordNote
+//
+// Allows user to record a note that was played at a known
+// time, instead of the time that setNote is called. This is
+// useful when buttons are only read every few milliseconds,
+// or when notes arrive from a MIDI input with a timestamp.
+// The input latency set with setInputLatency is subtracted
+// from the timestamp, and the note is stored on the closest
+// step of the shuffled grid. If microtiming is enabled, the
+// note is stored on the step before it was played instead,
+// along with how far after that step it was played, so it
+// is played back with the same feel.
+//
+// @access public
+// @param channel of note
+// @param pitch of note
+// @param velocity of note, zero for note off
+// @param time the note was played in microseconds
+// @return byte - FS_NOTE_STORED, FS_NOTE_REMOVED, FS_NOTE_DROPPED, FS_NOTE_PENDING or FS_NOTE_IGNORED
+//
+byte FifteenStep::recordNote(byte channel, byte pitch, byte velocity, unsigned long timestamp)
+{
 
-    // use the free slot
-    if(_sequence[i].pitch == 0 && _sequence[i].step == 0 && _sequence[i].channel == 0 && !added)
-    {
+  // don't save notes if the sequencer isn't running
+  if(! _running)
+    return FS_NOTE_IGNORED;
 
-      _sequence[i].channel = channel;
-      _sequence[i].pitch = pitch;
-      _sequence[i].velocity = velocity;
-      _sequence[i].step = position;
+  unsigned long delay = 0;
+  bool keep = _microtiming && velocity > 0;
+  int position = _offset() + _quantize(timestamp - _latency, keep, delay);
+  byte result = _storeNote(channel, pitch, velocity, position);
 
-      added = true;
+  if(result != FS_NOTE_STORED || ! keep)
+    return result;
 
-    }
+  // delay as a fraction of a sixteenth
+  unsigned long timing = delay * 256 / (_sixteenth * 1000);
 
-  }
+  if(timing == 0)
+    return result;
 
-  _heapSort();
+  FifteenStepTrig* trig = _addTrig(channel, pitch, position);
+
+  if(trig)
+    trig->timing = timing > 255 ? 255 : timing;
+
+  return result;
 
 }
 
-// pause
+// setInputLatency
 //
-// Pauses and unpauses the sequencer at
-// the current position
+// Allows user to set how long it takes for a played note to
+// reach recordNote, in microseconds. This is subtracted from
+// the timestamps passed to recordNote before they are
+// quantized.
 //
 // @access public
+// @param latency in microseconds
 // @return void
 //
-void FifteenStep::pause()
+void FifteenStep::setInputLatency(unsigned long latency)
 {
-  _running = _running ? false : true;
+  _latency = latency;
 }
 
-// start
+// setMicrotiming
 //
-// Starts sequencer at position 0
+// Allows user to choose if recordNote keeps the exact timing
+// of recorded notes. When enabled, notes are played back
+// late by the amount they were played after their step.
 //
 // @access public
+// @param true to keep the timing of recorded notes
 // @return void
 //
-void FifteenStep::start()
+void FifteenStep::setMicrotiming(bool keep)
 {
-  _position = 0;
-  _running = true;
+  _microtiming = keep;
 }
 
-// stop
+// setProbability
 //
-// Stops sequencer at current position
+// Allows user to set the chance that a note on plays each
+// time its step comes around. The note on must already be
+// in the sequence, and the step is relative to the start
+// of the current pattern. Decisions come from the random
+// number generator, so setSeed can be used to get the same
+// results every time. If a note doesn't play, its note off
+// is still sent, which keeps hanging notes from happening.
 //
 // @access public
-// @return void
+// @param channel of note
+// @param pitch of note
+// @param percent chance the note plays, from 0 to 100
+// @param position in the pattern
+// @return bool - false if the note isn't there or the trig table is full
 //
-void FifteenStep::stop()
+bool FifteenStep::setProbability(byte channel, byte pitch, byte percent, byte step)
 {
-  _running = false;
+
+  int position = _offset() + step;
+
+  if(! _hasNoteOn(channel, pitch, position))
+    return false;
+
+  if(percent >= 100 && ! _findTrig(channel, pitch, position))
+    return true;
+
+  FifteenStepTrig* trig = _addTrig(channel, pitch, position);
+
+  if(! trig)
+    return false;
+
+  trig->probability = percent > 100 ? 100 : percent;
+
+  _trimTrig(trig);
+
+  return true;
+
 }
 
-// panic
+// setCondition
 //
-// Turns all notes off and resets sequence
+// Allows user to choose which loops a note on plays on.
+// FS_TRIG_FIRST only plays on the first loop after start,
+// and FS_TRIG_NOT_FIRST plays on every loop but the first.
+// FS_TRIG_EVERY(a, b) plays on loop a out of every b loops,
+// so FS_TRIG_EVERY(1, 4) plays on the first of every four.
+// Use FS_TRIG_ALWAYS to play on every loop again.
 //
 // @access public
-// @return void
+// @param channel of note
+// @param pitch of note
+// @param one of the FS_TRIG_* conditions
+// @param position in the pattern
+// @return bool - false if the note isn't there or the trig table is full
 //
-void FifteenStep::panic()
+bool FifteenStep::setCondition(byte channel, byte pitch, byte condition, byte step)
 {
 
-  for(int i=0; i < 16; ++i)
-  {
-    // send all notes off for each channel if callback is set
-    if(_midi_cb)
-      _midi_cb(i, 0x7B, 0x0, 0x0);
-  }
+  int position = _offset() + step;
+
+  if(! _hasNoteOn(channel, pitch, position))
+    return false;
+
+  if(condition == FS_TRIG_ALWAYS && ! _findTrig(channel, pitch, position))
+    return true;
+
+  FifteenStepTrig* trig = _addTrig(channel, pitch, position);
+
+  if(! trig)
+    return false;
+
+  trig->condition = condition;
+
+  _trimTrig(trig);
+
+  return true;
+
+}
+
+// setRatchet
+//
+// Allows user to repeat a note on from 2 to FS_MAX_RATCHET
+// times, spread evenly over its step. Each repeat turns the
+// last one off first, and is quieter than the last one by the
+// decay percent. The repeats are sent from a single scheduled
+// event, so they don't use any extra slots in the sequence.
+// Pass 0 or 1 repeats to play the note once again.
+//
+// @access public
+// @param channel of note
+// @param pitch of note
+// @param number of times to play the note
+// @param position in the pattern
+// @param percent quieter each repeat is
+// @return bool - false if the note isn't there or the trig table is full
+//
+bool FifteenStep::setRatchet(byte channel, byte pitch, byte repeats, byte step, byte decay)
+{
+
+  int position = _offset() + step;
+
+  if(! _hasNoteOn(channel, pitch, position))
+    return false;
+
+  if(repeats < 2)
+    repeats = 0;
+  else if(repeats > FS_MAX_RATCHET)
+    repeats = FS_MAX_RATCHET;
+
+  if(repeats == 0 && ! _findTrig(channel, pitch, position))
+    return true;
+
+  FifteenStepTrig* trig = _addTrig(channel, pitch, position);
+
+  if(! trig)
+    return false;
+
+  trig->ratchet = repeats;
+  trig->decay = decay > 100 ? 100 : decay;
+
+  _trimTrig(trig);
+
+  return true;
+
+}
+
+// setLock
+//
+// Allows user to lock a MIDI controller to a value on a step,
+// which is sent as a control change before the notes on that
+// step. This can be used to sequence filter sweeps or other
+// automation without using note slots. Each channel and
+// controller is a lane, and only the steps that have a value
+// are stored. The step is relative to the start of the
+// current pattern, and the controller and value are
+// 7 bit MIDI data.
+//
+// @access public
+// @param MIDI channel
+// @param controller number
+// @param controller value
+// @param position in the pattern
+// @return bool - false if the lock table is full, the step is
+//                past the end of the pattern or a byte is over 127
+//
+bool FifteenStep::setLock(byte channel, byte controller, byte value, byte step)
+{
+
+  // anything over 127 would be sent as a status byte
+  if(controller > 127 || value > 127)
+    return false;
+
+  if(step >= _steps)
+    return false;
+
+  int position = _offset() + step;
+
+  if(position >= FS_MAX_STEPS)
+    return false;
+
+  int i = _firstLock(position);
+
+  // locks on a step are ordered by channel and controller
+  for(; i < _lock_count && _locks[i].step == position; ++i)
+  {
+
+    if(_locks[i].channel == channel && _locks[i].controller == controller) {
+      _locks[i].value = value;
+      return true;
+    }
+
+    if(_locks[i].channel > channel || (_locks[i].channel == channel && _locks[i].controller > controller))
+      break;
+
+  }
+
+  if(! _locks)
+    _locks = new FifteenStepLock[FS_MAX_LOCKS];
+
+  if(_lock_count >= FS_MAX_LOCKS)
+    return false;
+
+  for(int j = _lock_count; j > i; --j)
+    _locks[j] = _locks[j - 1];
+
+  _locks[i].channel = channel;
+  _locks[i].controller = controller;
+  _locks[i].step = position;
+  _locks[i].value = value;
+
+  _lock_count++;
+
+  return true;
+
+}
+
+// clearLock
+//
+// Removes the lock for a controller on a step,
+// if there is one. The step is relative to the
+// start of the current pattern.
+//
+// @access public
+// @param MIDI channel
+// @param controller number
+// @param position in the pattern
+// @return void
+//
+void FifteenStep::clearLock(byte channel, byte controller, byte step)
+{
+
+  int position = _offset() + step;
+
+  for(int i = _firstLock(position); i < _lock_count && _locks[i].step == position; ++i)
+  {
+    if(_locks[i].channel == channel && _locks[i].controller == controller) {
+      _removeLock(i);
+      return;
+    }
+  }
+
+}
+
+// clearLocks
+//
+// Removes every lock in a lane from
+// the current pattern.
+//
+// @access public
+// @param MIDI channel
+// @param controller number
+// @return void
+//
+void FifteenStep::clearLocks(byte channel, byte controller)
+{
+
+  int offset = _offset();
+
+  for(int i = _lock_count - 1; i >= 0; --i)
+  {
+
+    if(_locks[i].step < offset || _locks[i].step >= offset + _steps)
+      continue;
+
+    if(_locks[i].channel == channel && _locks[i].controller == controller)
+      _removeLock(i);
+
+  }
+
+}
+
+// setMute
+//
+// Allows user to mute a MIDI channel. Muted notes stay in
+// the sequence, and their note offs are still sent so notes
+// that are already playing don't hang. The change is heard
+// from the next step.
+//
+// @access public
+// @param MIDI channel
+// @param true to mute
+// @return void
+//
+void FifteenStep::setMute(byte channel, bool mute)
+{
+
+  if(channel > 15)
+    return;
+
+  if(mute)
+    _mute |= 1 << channel;
+  else
+    _mute &= ~(1 << channel);
+
+  _updateSilent();
+
+}
+
+// setSolo
+//
+// Allows user to solo a MIDI channel. While any channel
+// is soloed, only soloed channels are played. A channel
+// that is both soloed and muted stays muted.
+//
+// @access public
+// @param MIDI channel
+// @param true to solo
+// @return void
+//
+void FifteenStep::setSolo(byte channel, bool solo)
+{
+
+  if(channel > 15)
+    return;
+
+  if(solo)
+    _solo |= 1 << channel;
+  else
+    _solo &= ~(1 << channel);
+
+  _updateSilent();
+
+}
+
+// setMuteMask
+//
+// Allows user to mute all 16 MIDI channels at once. Each
+// bit is a channel, starting with channel 0 in bit 0.
+//
+// @access public
+// @param mute mask
+// @return void
+//
+void FifteenStep::setMuteMask(uint16_t mask)
+{
+  _mute = mask;
+  _updateSilent();
+}
+
+// setSoloMask
+//
+// Allows user to solo all 16 MIDI channels at once. Each
+// bit is a channel, starting with channel 0 in bit 0.
+//
+// @access public
+// @param solo mask
+// @return void
+//
+void FifteenStep::setSoloMask(uint16_t mask)
+{
+  _solo = mask;
+  _updateSilent();
+}
+
+// getMuteMask
+//
+// Returns the muted channels as a bit mask.
+//
+// @access public
+// @return uint16_t
+//
+uint16_t FifteenStep::getMuteMask()
+{
+  return _mute;
+}
+
+// getSoloMask
+//
+// Returns the soloed channels as a bit mask.
+//
+// @access public
+// @return uint16_t
+//
+uint16_t FifteenStep::getSoloMask()
+{
+  return _solo;
+}
+
+// setArpeggiator
+//
+// Turns the arpeggiator on or off. While it is on, the notes
+// held with arpNoteOn are played one at a time, on every
+// division steps, in the order set by mode. The notes can be
+// played over 1 to FS_ARP_OCTAVES octaves. Pass FS_ARP_OFF
+// to turn it off.
+//
+// @access public
+// @param FS_ARP_UP, FS_ARP_DOWN, FS_ARP_UP_DOWN, FS_ARP_RANDOM, FS_ARP_PLAYED or FS_ARP_OFF
+// @param number of octaves to play the notes over
+// @param number of steps between notes
+// @param MIDI channel
+// @return void
+//
+void FifteenStep::setArpeggiator(byte mode, byte octaves, byte division, byte channel)
+{
+
+  _arpRelease();
+
+  _arp_mode = mode;
+  _arp_octaves = octaves > 0 ? octaves : 1;
+
+  if(_arp_octaves > FS_ARP_OCTAVES)
+    _arp_octaves = FS_ARP_OCTAVES;
+  _arp_division = division > 0 ? division : 1;
+  _arp_channel = channel;
+  _arp_index = 0;
+
+  // play on the next step
+  _arp_tick = _arp_division - 1;
+
+}
+
+// setArpGate
+//
+// Allows user to set how long each arpeggiator note is
+// held, as a percent of the time between notes. The note
+// offs are scheduled in between steps. At 100 percent, or
+// if the queue is full, each note is held until the next.
+//
+// @access public
+// @param gate length in percent
+// @return void
+//
+void FifteenStep::setArpGate(byte percent)
+{
+  _arp_gate = percent > 100 ? 100 : percent;
+}
+
+// setArpRecord
+//
+// Allows user to record the notes played by the
+// arpeggiator into the current pattern. Notes that
+// are already there are left alone, so a pattern
+// doesn't get erased when it comes around again.
+//
+// @access public
+// @param true to record
+// @return void
+//
+void FifteenStep::setArpRecord(bool record)
+{
+  _arp_record = record;
+}
+
+// arpNoteOn
+//
+// Adds a note to the notes held by the arpeggiator.
+// They are kept in pitch order and in the order they
+// were played, so the next note can be found without
+// sorting. If FS_ARP_NOTES are already held, the
+// oldest note is let go.
+//
+// @access public
+// @param pitch of note
+// @param velocity of note, zero to let go
+// @return void
+//
+void FifteenStep::arpNoteOn(byte pitch, byte velocity)
+{
+
+  if(velocity == 0) {
+    arpNoteOff(pitch);
+    return;
+  }
+
+  _arp_velocity = velocity;
+
+  for(byte i = 0; i < _arp_count; ++i)
+  {
+    if(_arp_order[i] == pitch)
+      return;
+  }
+
+  if(_arp_count == FS_ARP_NOTES)
+    arpNoteOff(_arp_order[0]);
+
+  byte i = _arp_count;
+
+  // insert in pitch order
+  for(; i > 0 && _arp_notes[i - 1] > pitch; --i)
+    _arp_notes[i] = _arp_notes[i - 1];
+
+  _arp_notes[i] = pitch;
+  _arp_order[_arp_count++] = pitch;
+
+}
+
+// arpNoteOff
+//
+// Removes a note from the notes held
+// by the arpeggiator.
+//
+// @access public
+// @param pitch of note
+// @return void
+//
+void FifteenStep::arpNoteOff(byte pitch)
+{
+
+  byte n = 0;
+  byte o = 0;
+
+  for(byte i = 0; i < _arp_count; ++i)
+  {
+
+    if(_arp_notes[i] != pitch)
+      _arp_notes[n++] = _arp_notes[i];
+
+    if(_arp_order[i] != pitch)
+      _arp_order[o++] = _arp_order[i];
+
+  }
+
+  _arp_count = n;
+
+}
+
+// setOverdub
+//
+// Allows user to record over the sequence without erasing
+// anything. While overdubbing, setNote and recordNote only
+// add notes, and a note that is already there is ignored
+// instead of being turned off. Each time around the loop is
+// a pass, and the notes added in the last FS_UNDO_PASSES
+// passes can be taken back out with undoLastPass. The undo
+// log holds FS_UNDO_SIZE notes, so the oldest notes of a
+// very long pass can't be undone.
+//
+// @access public
+// @param true to overdub
+// @return void
+//
+void FifteenStep::setOverdub(bool overdub)
+{
+
+  _overdub = overdub;
+
+  if(overdub)
+    _nextPass();
+
+}
+
+// undoLastPass
+//
+// Removes the notes added by the last overdub pass that
+// added any. Each note is found with a binary search, and
+// the sequence is packed once, so nothing is sorted and
+// the pattern is never copied. Call it again to undo the
+// pass before that one.
+//
+// @access public
+// @return int - number of notes removed
+//
+int FifteenStep::undoLastPass()
+{
+
+  // skip passes that didn't add anything
+  while(_pass_count > 0 && _undo_passes[_pass_count - 1] == 0)
+    _pass_count--;
+
+  if(_pass_count == 0)
+    return 0;
+
+  if(_edit_count > 0)
+    _applyEdits();
+
+  byte count = _undo_passes[--_pass_count];
+  int end = 0;
+  int removed = 0;
+
+  // take the notes back out, newest first
+  for(byte i = 0; i < count; ++i)
+  {
+
+    FifteenStepNote &note = _undo[(_undo_start + _undo_count - 1) % FS_UNDO_SIZE];
+    int slot = _findNote(note.channel, note.pitch, note.velocity > 0, note.step);
+
+    _undo_count--;
+
+    if(slot < 0)
+      continue;
+
+    if(note.velocity > 0)
+      _removeTrig(note.channel, note.pitch, note.step);
+
+    // mark the note instead of clearing it, so the
+    // binary search still works for the next one
+    _sequence[slot].channel |= 0x80;
+    _markDirty(note.step);
+
+    if(_journal)
+      _journal->record(note.channel, note.pitch, note.velocity, note.step);
+
+    if(slot >= end)
+      end = slot + 1;
+
+    removed++;
+
+  }
+
+  for(int i = 0; i < end; ++i)
+  {
+    if(_sequence[i].channel & 0x80)
+      _sequence[i] = DEFAULT_NOTE;
+  }
+
+  // the notes after the last removed slot don't move
+  if(removed > 0)
+    _packSlots(end);
+
+  // keep recording into a new pass
+  if(_overdub)
+    _nextPass();
+
+  return removed;
+
+}
+
+// beginEdit
+//
+// Starts a group of edits. Notes passed to setNote() are
+// kept aside until commitEdit() is called, and then they
+// are all merged in at once, so loading a preset or pasting
+// a bar doesn't sort the sequence once per note.
+// Playback keeps using the notes from before the edit until
+// it is committed. setNote() returns FS_NOTE_PENDING for
+// each edit, and recorded notes don't keep their microtiming.
+// Edits can be nested, and are applied when the outermost
+// edit is committed. Pending edits are held in free slots,
+// so if the sequence runs out of room they are applied early.
+//
+// @access public
+// @return void
+//
+void FifteenStep::beginEdit()
+{
+  _edit_depth++;
+}
+
+// commitEdit
+//
+// Applies the edits made since beginEdit() and merges
+// them into the sequence in one pass.
+//
+// @access public
+// @return void
+//
+void FifteenStep::commitEdit()
+{
+
+  if(_edit_depth == 0)
+    return;
+
+  _edit_depth--;
+
+  if(_edit_depth == 0)
+    _applyEdits();
+
+}
+
+// transpose
+//
+// Moves the pitch of every note in the current pattern up or
+// down by a number of semitones. Pass a MIDI channel to only
+// transpose that channel. Notes that would go past the MIDI
+// pitch range are removed. This runs in one pass over the
+// pattern, and can wait for the end of the loop so the
+// change doesn't land in the middle of a phrase. Notes
+// that are sounding are turned off before they move.
+//
+// @access public
+// @param semitones to move, negative to move down
+// @param MIDI channel or FS_ANY_CHANNEL
+// @param true to wait for the end of the loop
+// @return bool - false if too many transforms are waiting
+//
+bool FifteenStep::transpose(int semitones, byte channel, bool atLoop)
+{
+  return _queueTransform(FS_TRANSFORM_TRANSPOSE, semitones, channel, atLoop);
+}
+
+// rotate
+//
+// Shifts every note in the current pattern forward by a
+// number of steps. Notes that go past the end of the pattern
+// wrap around to the start. Negative values shift the notes
+// backward. Parameter locks move with their steps.
+//
+// @access public
+// @param steps to shift
+// @param true to wait for the end of the loop
+// @return bool - false if too many transforms are waiting
+//
+bool FifteenStep::rotate(int steps, bool atLoop)
+{
+  return _queueTransform(FS_TRANSFORM_ROTATE, steps, FS_ANY_CHANNEL, atLoop);
+}
+
+// reverse
+//
+// Reverses the current pattern, so it plays backward. Each
+// note keeps its length, so a note that starts on the first
+// step and ends on the third will end on the last step.
+// Only FS_HELD_NOTES notes can be held over each other at
+// once when matching note ons with their note offs, and
+// notes that can't be matched are mirrored one event at a
+// time. Parameter locks are mirrored with their steps.
+//
+// @access public
+// @param true to wait for the end of the loop
+// @return bool - false if too many transforms are waiting
+//
+bool FifteenStep::reverse(bool atLoop)
+{
+  return _queueTransform(FS_TRANSFORM_REVERSE, 0, FS_ANY_CHANNEL, atLoop);
+}
+
+// scaleVelocity
+//
+// Scales the velocity of every note on in the current
+// pattern by a percentage. Pass a MIDI channel to only
+// scale that channel. Note ons are kept between 1 and 127
+// so they don't turn into note offs.
+//
+// @access public
+// @param percent to scale by, 100 leaves velocities alone
+// @param MIDI channel or FS_ANY_CHANNEL
+// @param true to wait for the end of the loop
+// @return bool - false if too many transforms are waiting
+//
+bool FifteenStep::scaleVelocity(int percent, byte channel, bool atLoop)
+{
+  return _queueTransform(FS_TRANSFORM_VELOCITY, percent, channel, atLoop);
+}
+
+// euclid
+//
+// Replaces a note in the current pattern with a euclidean
+// rhythm, which spreads a number of hits as evenly as
+// possible over a number of steps. The rhythm repeats if the
+// pattern is longer than it. The new notes are merged into
+// the sequence in one pass, so there is no need to call
+// setNote for every hit.
+//
+// @access public
+// @param number of hits
+// @param number of steps in the rhythm
+// @param steps to rotate the rhythm by
+// @param MIDI channel
+// @param pitch of note
+// @param velocity of note
+// @param length of each note in steps
+// @return int - number of hits stored
+//
+int FifteenStep::euclid(byte hits, byte steps, byte rotation, byte channel, byte pitch, byte velocity, byte length)
+{
+
+  byte bits[FS_MAX_STEPS / 8] = {0};
+
+  if(steps == 0)
+    steps = _steps;
+
+  // the step count can overflow to zero, and there
+  // would be nothing to spread the hits over
+  if(steps == 0)
+    return 0;
+
+  if(hits > steps)
+    hits = steps;
+
+  for(int i = 0; i < _steps; ++i)
+  {
+
+    int position = (i % steps + steps - rotation % steps) % steps;
+
+    // bresenham's line gives the same spacing as bjorklund
+    if((position * hits) % steps < hits)
+      bits[i >> 3] |= 1 << (i & 7);
+
+  }
+
+  return _generate(bits, channel, pitch, velocity, length);
+
+}
+
+// randomFill
+//
+// Replaces a note in the current pattern with random hits.
+// Each step has a density percent chance of getting a hit.
+// Use setSeed to get the same pattern again.
+//
+// @access public
+// @param chance of a hit on each step, from 0 to 100
+// @param MIDI channel
+// @param pitch of note
+// @param velocity of note
+// @param length of each note in steps
+// @return int - number of hits stored
+//
+int FifteenStep::randomFill(byte density, byte channel, byte pitch, byte velocity, byte length)
+{
+
+  byte bits[FS_MAX_STEPS / 8] = {0};
+
+  for(int i = 0; i < _steps; ++i)
+  {
+    if(_random() % 100 < density)
+      bits[i >> 3] |= 1 << (i & 7);
+  }
+
+  return _generate(bits, channel, pitch, velocity, length);
+
+}
+
+// setSeed
+//
+// Sets the seed of the random number generator
+// used by randomFill and probability trigs. Zero
+// is not a valid seed, so it is replaced with the
+// default seed.
+//
+// @access public
+// @param seed
+// @return void
+//
+void FifteenStep::setSeed(uint32_t seed)
+{
+  _seed = seed ? seed : 0x2545F491;
+}
+
+// setPattern
+//
+// Allows user to select which stored pattern is played
+// and edited. Patterns are pages of the sequence that are
+// the length of the current step count, so the number of
+// patterns available is limited by FS_MAX_STEPS. Setting
+// a pattern will not change the song position if a song
+// has been set.
+//
+// @access public
+// @param the id of the pattern to select
+// @return void
+//
+void FifteenStep::setPattern(byte pattern)
+{
+
+  // ignore patterns that won't fit in the step range
+  if((pattern + 1) * _steps > FS_MAX_STEPS)
+    return;
+
+  _pattern = pattern;
+
+  // keep track of how many patterns are in use
+  // so setSteps knows which notes to keep
+  if(_pattern >= _patterns)
+    _patterns = _pattern + 1;
+
+}
+
+// setSong
+//
+// Allows user to set a song arrangement that the sequencer
+// will walk through automatically. Each time the loop
+// finishes, the repeat count of the current entry is checked
+// and the next entry's pattern is selected when it has been
+// played enough times. The song array is not copied, so it
+// must stay in scope for as long as the song is playing.
+// Pass NULL to go back to playing a single pattern.
+//
+// @access public
+// @param array of song entries
+// @param number of entries in the array
+// @param start over after the last entry, or stop
+// @return void
+//
+void FifteenStep::setSong(const FifteenStepSongEntry* song, byte length, bool repeat)
+{
+
+  _song = song;
+  _song_length = song ? length : 0;
+  _song_repeat = repeat;
+  _song_index = 0;
+  _song_loops = 0;
+
+  // nothing to play
+  if(_song_length == 0)
+    return;
+
+  // make sure every pattern in the song is kept by setSteps
+  for(byte i = 0; i < _song_length; ++i)
+    setPattern(_song[i].pattern);
+
+  setPattern(_song[0].pattern);
+
+}
+
+// pause
+//
+// Pauses and unpauses the sequencer at
+// the current position
+//
+// @access public
+// @return void
+//
+void FifteenStep::pause()
+{
+  _running = _running ? false : true;
+}
+
+// start
+//
+// Starts sequencer at position 0
+//
+// @access public
+// @return void
+//
+void FifteenStep::start()
+{
+  _position = 0;
+  _loops = 0;
+  _running = true;
+}
+
+// stop
+//
+// Stops sequencer at current position
+//
+// @access public
+// @return void
+//
+void FifteenStep::stop()
+{
+  _running = false;
+}
+
+// panic
+//
+// Turns all notes off and resets sequence
+//
+// @access public
+// @return void
+//
+void FifteenStep::panic()
+{
+
+  for(int i=0; i < 16; ++i)
+  {
+    // send all notes off for each channel
+    _send(i, 0x7B, 0x0, 0x0);
+  }
+
+  // drop anything that was scheduled
+  _queue_count = 0;
 
   // clear notes
   _resetSequence();
 
+  // save the empty sequence
+  if(_journal)
+    _journal->compact();
+
+}
+
+// getSequence
+//
+// Returns a pointer to the current sequence
+//
+// @access private
+// @return FifteenStepNote*
+//
+FifteenStepNote* FifteenStep::getSequence()
+{
+  return _sequence;
+}
+
+// getStats
+//
+// Returns a copy of the runtime counters. The run() call
+// rate can be found by dividing runs by elapsed, and the
+// average notes per step by dividing notes by steps.
+//
+// @access public
+// @return FifteenStepStats
+//
+FifteenStepStats FifteenStep::getStats()
+{
+
+  FifteenStepStats stats = _stats;
+
+  stats.elapsed = _now() - _stats_start;
+
+  return stats;
+
+}
+
+// resetStats
+//
+// Clears the runtime counters, so a sketch can print or
+// send them periodically and start counting again.
+//
+// @access public
+// @return void
+//
+void FifteenStep::resetStats()
+{
+
+  _stats.elapsed = 0;
+  _stats.runs = 0;
+  _stats.max_gap = 0;
+  _stats.steps = 0;
+  _stats.late_steps = 0;
+  _stats.total_late = 0;
+  _stats.max_late = 0;
+  _stats.notes = 0;
+  _stats.max_notes = 0;
+  _stats.max_set_note = 0;
+  _stats.max_used = _usedSlots();
+  _stats.dropped = 0;
+
+  _stats_start = _now();
+
+}
+
+// getCapacity
+//
+// Returns the number of notes the sequence can hold,
+// which is set by the amount of memory passed to the
+// constructor. Note ons and note offs each use a slot.
+//
+// @access public
+// @return int
+//
+int FifteenStep::getCapacity()
+{
+  return _sequence_size;
+}
+
+// getUsedSlots
+//
+// Returns the number of slots that hold notes. The most
+// slots used at once is kept in the runtime stats.
+//
+// @access public
+// @return int
+//
+int FifteenStep::getUsedSlots()
+{
+  return _usedSlots();
+}
+
+// getFreeSlots
+//
+// Returns the number of notes that can still be stored,
+// so a UI can warn before the sequence fills up.
+//
+// @access public
+// @return int
+//
+int FifteenStep::getFreeSlots()
+{
+  return _sequence_size - _usedSlots();
+}
+
+// getStepSlots
+//
+// Returns the number of note ons and note offs stored
+// at a step. The step is relative to the start of the
+// current pattern.
+//
+// @access public
+// @param step position
+// @return int
+//
+int FifteenStep::getStepSlots(byte step)
+{
+
+  int position = _offset() + step;
+  int count = 0;
+
+  for(int i = _firstAt(position); i < _sequence_size && _sequence[i].step == position; ++i)
+    count++;
+
+  return count;
+
+}
+
+// forEachNote
+//
+// Calls the passed callback with every note from the first
+// step up to, but not including, the last step. Steps are
+// relative to the start of the current pattern. Pass a MIDI
+// channel to only visit the notes on that channel, or
+// FS_ANY_CHANNEL to visit all of them. Notes are kept in step
+// order, so the first note is found with a binary search and
+// visiting a page of steps only touches the notes on it.
+//
+// @access public
+// @param first step
+// @param step after the last step
+// @param MIDI channel or FS_ANY_CHANNEL
+// @param the callback to call with each note
+// @param user data passed to the callback
+// @return int - number of notes visited
+//
+int FifteenStep::forEachNote(byte first, byte last, byte channel, NoteCallback cb, void* context)
+{
+
+  int offset = _offset();
+  int end = offset + last;
+  int count = 0;
+
+  for(int i = _firstAt(offset + first); i < _sequence_size && _sequence[i].step < end; ++i)
+  {
+
+    if(channel != FS_ANY_CHANNEL && _sequence[i].channel != channel)
+      continue;
+
+    if(cb)
+      cb(context, _sequence[i].channel, _sequence[i].pitch, _sequence[i].velocity, _sequence[i].step - offset);
+
+    count++;
+
+  }
+
+  return count;
+
+}
+
+// nextChange
+//
+// Finds the next step of the current pattern that has been
+// edited since it was last returned, so a display only needs
+// to redraw the steps that changed instead of the whole grid.
+// Every step is marked as changed when the whole sequence is
+// replaced. Changes to other patterns are kept until that
+// pattern is selected. Changes are kept per step, not per
+// channel or pitch, so an edit on any channel marks the whole
+// step and a display showing one channel may redraw a step
+// that looks the same. Call this in a loop until it returns
+// false.
+//
+// @access public
+// @param set to the changed step in the current pattern
+// @return bool - false if nothing else has changed
+//
+bool FifteenStep::nextChange(int &position)
+{
+
+  int offset = _offset();
+  int end = offset + _steps;
+
+  for(int p = offset; p < end && p < FS_MAX_STEPS; ++p)
+  {
+
+    // skip over eight steps at a time if none changed
+    if(! _dirty[p >> 3]) {
+      p |= 7;
+      continue;
+    }
+
+    if(! (_dirty[p >> 3] & (1 << (p & 7))))
+      continue;
+
+    _dirty[p >> 3] &= ~(1 << (p & 7));
+    position = p - offset;
+
+    return true;
+
+  }
+
+  return false;
+
+}
+
+// clearChanges
+//
+// Forgets every change, for example after
+// redrawing the whole display.
+//
+// @access public
+// @return void
+//
+void FifteenStep::clearChanges()
+{
+  for(int i = 0; i < FS_MAX_STEPS / 8; ++i)
+    _dirty[i] = 0;
+}
+
+// getPosition
+//
+// Returns the closest 16th note to the
+// present time. This is used to see where to
+// save the new note.
+//
+// @access public
+// @return byte - quantized position
+//
+byte FifteenStep::getPosition()
+{
+  return _quantizedPosition();
+}
+
+// serialize
+//
+// Saves the sequence and settings (tempo, steps, shuffle)
+// in a compact binary format by passing small chunks to the
+// write callback. Notes are grouped into lanes that share
+// the same channel, pitch and velocity, and the steps in
+// each lane are stored as run length encoded step deltas,
+// so a sparse pattern only takes a few bytes per lane. The
+// notes are sorted by lane while they are written, so each
+// note is only visited once.
+//
+// The format is versioned with FS_FORMAT_VERSION:
+//
+// header: 'F' 'S' version tempo steps shuffle patterns lanes(2)
+// lane:   channel pitch velocity runs, then [delta count] x runs
+//
+// @access public
+// @param callback that will receive the data
+// @param user data passed to the callback
+// @return int - number of bytes written
+//
+int FifteenStep::serialize(WriteCallback cb, void* context)
+{
+
+  if(! cb)
+    return 0;
+
+  // include edits that haven't been committed yet
+  if(_edit_count > 0)
+    _applyEdits();
+
+  FifteenStepBuffer out = {cb, NULL, context, {0}, 0, 0, 0};
+  unsigned long div = _shuffleDivision();
+  int first = _sequence_size - _usedSlots();
+  int lanes = 0;
+
+  // group the notes by lane so each lane is walked once
+  _heapSort(true);
+
+  // count the lanes so the loader knows when to stop
+  for(int i = first; i < _sequence_size; i = _laneEnd(i))
+    lanes++;
+
+  out.put('F');
+  out.put('S');
+  out.put(FS_FORMAT_VERSION);
+  out.put(_tempo);
+  out.put(_steps);
+  out.put(div > 0 ? _shuffle / div : 0);
+  out.put(_patterns);
+  out.put(lanes >> 8);
+  out.put(lanes & 0xFF);
+
+  for(int i = first; i < _sequence_size;)
+  {
+
+    int end = _laneEnd(i);
+
+    out.put(_sequence[i].channel);
+    out.put(_sequence[i].pitch);
+    out.put(_sequence[i].velocity);
+
+    // count first, then write the runs
+    out.put(_laneRuns(i, end, NULL));
+    _laneRuns(i, end, &out);
+
+    i = end;
+
+  }
+
+  out.flush();
+
+  // put the notes back in step order
+  _heapSort();
+
+  return out.total;
+
+}
+
+// deserialize
+//
+// Loads a sequence that was saved with serialize(). The
+// current notes are replaced, and the tempo, step count and
+// shuffle are restored. Notes are copied straight into free
+// slots and the sequence is sorted once at the end, so load
+// time is linear in the size of the saved data. The current
+// notes are only replaced once all of the data has been
+// read, so data that is cut short, or that has more notes
+// than there are free slots, leaves the sequence as it was.
+// Call panic() first to load over a full sequence.
+//
+// @access public
+// @param callback that will supply the data
+// @param user data passed to the callback
+// @return bool - true if the whole sequence was loaded
+//
+bool FifteenStep::deserialize(ReadCallback cb, void* context)
+{
+
+  if(! cb)
+    return false;
+
+  byte header[9];
+
+  // the loaded notes go in the free slots
+  if(_edit_count > 0)
+    _applyEdits();
+
+  if(! _readSequence(cb, context, header, true)) {
+    _endStage(false, 0, 0);
+    return false;
+  }
+
+  // trigs, locks and undo belonged to the old notes
+  _trig_count = 0;
+  _lock_count = 0;
+  _clearUndo();
+
+  _endStage(true, 0, FS_MAX_STEPS);
+  _markAllDirty();
+
+  setTempo(header[3]);
+  _patterns = header[6] > 0 ? header[6] : 1;
+  setSteps(header[4]);
+
+  if(_pattern >= _patterns)
+    _pattern = 0;
+
+  // restore shuffle, keeping it inside the sixteenth
+  _shuffle = header[5] * _shuffleDivision();
+
+  if(_shuffle >= _sixteenth)
+    _shuffle = 0;
+
+  // save a snapshot of the new sequence
+  if(_journal)
+    _journal->compact();
+
+  return true;
+
+}
+
+// exportMidi
+//
+// Writes the current pattern as a Standard MIDI File by
+// passing small chunks to the write callback, so the file
+// never has to fit in memory. If a song has been set, the
+// whole arrangement is exported instead. Notes are placed
+// on a grid of FS_MIDI_PPQ ticks per quarter note, and the
+// current tempo and shuffle are used for the timing.
+//
+// Format 0 writes all channels to a single track. Format 1
+// writes a tempo track followed by one track per channel.
+//
+// @access public
+// @param callback that will receive the file data
+// @param user data passed to the callback
+// @param SMF format (0 or 1)
+// @return long - number of bytes written
+//
+long FifteenStep::exportMidi(WriteCallback cb, void* context, byte format)
+{
+
+  if(! cb)
+    return 0;
+
+  // include edits that haven't been committed yet
+  if(_edit_count > 0)
+    _applyEdits();
+
+  FifteenStepBuffer out = {cb, NULL, context, {0}, 0, 0, 0};
+  unsigned int channels = 0;
+  unsigned int tracks = 1;
+
+  // find the channels in use
+  for(int i = 0; i < _sequence_size; ++i)
+  {
+    if(! _isEmpty(i))
+      channels |= 1 << (_sequence[i].channel & 0x0F);
+  }
+
+  if(format == 1) {
+
+    for(byte c = 0; c < 16; ++c)
+    {
+      if(channels & (1 << c))
+        tracks++;
+    }
+
+  } else {
+    format = 0;
+  }
+
+  // header chunk
+  out.put('M');
+  out.put('T');
+  out.put('h');
+  out.put('d');
+  out.putLong(6);
+  out.putInt(format);
+  out.putInt(tracks);
+  out.putInt(FS_MIDI_PPQ);
+
+  for(int c = -1; c < 16; ++c)
+  {
+
+    unsigned int mask;
+
+    // the first track has the tempo, and all notes for format 0
+    if(c < 0)
+      mask = format == 0 ? channels : 0;
+    else if(format == 1 && (channels & (1 << c)))
+      mask = 1 << c;
+    else
+      continue;
+
+    // walk the track once to find the chunk length
+    FifteenStepBuffer counter = {NULL, NULL, NULL, {0}, 0, 0, 0};
+    _midiTrack(counter, mask, c < 0);
+
+    out.put('M');
+    out.put('T');
+    out.put('r');
+    out.put('k');
+    out.putLong(counter.total);
+
+    _midiTrack(out, mask, c < 0);
+
+  }
+
+  out.flush();
+
+  return out.total;
+
+}
+
+// importMidi
+//
+// Reads a Standard MIDI File from the read callback and
+// replaces the notes in the current pattern with the note
+// on and off messages from all tracks. Note ons are moved
+// to the closest step using the current shuffle, and note
+// offs are moved to the next step so short notes still
+// get a note off after their note on. Notes past the end
+// of the pattern are dropped. The first tempo found in the
+// file is used as the new tempo. The current pattern is only
+// replaced once the whole file has been read, so a file that
+// is cut short, or that has more notes than there are free
+// slots, leaves the sequence and tempo as they were. The trigs
+// and locks of the pattern are cleared along with its notes.
+//
+// @access public
+// @param callback that will supply the file data
+// @param user data passed to the callback
+// @return bool - true if the whole file was loaded
+//
+bool FifteenStep::importMidi(ReadCallback cb, void* context)
+{
+
+  if(! cb)
+    return false;
+
+  // include edits that haven't been committed yet
+  if(_edit_count > 0)
+    _applyEdits();
+
+  FifteenStepBuffer in = {NULL, cb, context, {0}, 0, 0, 0};
+  unsigned long id, length;
+  unsigned int format, tracks, division;
+
+  if(! in.getLong(id) || ! in.getLong(length))
+    return false;
+
+  // check for the MThd header chunk
+  if(id != 0x4D546864UL || length < 6)
+    return false;
+
+  if(! in.getInt(format) || ! in.getInt(tracks) || ! in.getInt(division))
+    return false;
+
+  // SMPTE time divisions aren't supported
+  if((division & 0x8000) || division < 4)
+    return false;
+
+  if(! in.skip(length - 6))
+    return false;
+
+  int offset = _offset();
+
+  // put the tempo back if the file can't be loaded
+  int last_tempo = _tempo;
+  unsigned long last_shuffle = _shuffle;
+
+  unsigned long sixteenth = division / 4;
+  unsigned long shuffle = _shuffle * sixteenth / _sixteenth;
+  bool tempo = false;
+  bool loaded = true;
+  int slot = 0;
+
+  for(unsigned int track = 0; track < tracks && loaded;)
+  {
+
+    if(! in.getLong(id) || ! in.getLong(length)) {
+      loaded = false;
+      break;
+    }
+
+    // skip unknown chunks
+    if(id != 0x4D54726BUL) {
+      loaded = in.skip(length);
+      continue;
+    }
+
+    track++;
+
+    long end = in.total + length;
+    unsigned long tick = 0;
+    byte status = 0;
+
+    while(in.total < end)
+    {
+
+      unsigned long delta;
+      byte b;
+
+      if(! in.getVariable(delta) || ! in.get(b)) {
+        loaded = false;
+        break;
+      }
+
+      tick += delta;
+
+      // sysex and meta events cancel running status
+      if(b == 0xF0 || b == 0xF7 || b == 0xFF) {
+
+        byte type = 0;
+
+        if(b == 0xFF && ! in.get(type)) {
+          loaded = false;
+          break;
+        }
+
+        status = 0;
+
+        if(! in.getVariable(length)) {
+          loaded = false;
+          break;
+        }
+
+        // use the first tempo in the file
+        if(b == 0xFF && type == 0x51 && length == 3 && ! tempo) {
+
+          byte t[3];
+
+          if(! in.get(t[0]) || ! in.get(t[1]) || ! in.get(t[2])) {
+            loaded = false;
+            break;
+          }
+
+          unsigned long us = ((unsigned long) t[0] << 16) | ((unsigned long) t[1] << 8) | t[2];
+
+          if(us > 0)
+            setTempo(60000000UL / us);
+
+          shuffle = _shuffle * sixteenth / _sixteenth;
+          tempo = true;
+
+          continue;
+
+        }
+
+        if(! in.skip(length)) {
+          loaded = false;
+          break;
+        }
+
+        continue;
+
+      }
+
+      byte data1, data2 = 0;
+
+      if(b & 0x80) {
+
+        status = b;
+
+        if(! in.get(data1)) {
+          loaded = false;
+          break;
+        }
+
+      } else if(status) {
+        // running status
+        data1 = b;
+      } else {
+        loaded = false;
+        break;
+      }
+
+      byte type = status & 0xF0;
+
+      // program change and channel pressure only have one data byte
+      if(type != 0xC0 && type != 0xD0 && ! in.get(data2)) {
+        loaded = false;
+        break;
+      }
+
+      if(type != 0x80 && type != 0x90)
+        continue;
+
+      bool on = type == 0x90 && data2 > 0;
+      int step = _tickToStep(tick, sixteenth, shuffle, ! on);
+
+      // drop notes past the end of the pattern, but
+      // wrap note offs at the end back to the start
+      if(on && step >= _steps)
+        continue;
+
+      if(! on && step > _steps)
+        continue;
+
+      if(step >= _steps)
+        step = 0;
+
+      FifteenStepNote note = {(byte) (status & 0x0F), data1, (byte) (on ? data2 : 0), (byte) (offset + step)};
+
+      // only the free slots are used until the file is read
+      if(! _stageNote(slot, note)) {
+        loaded = false;
+        break;
+      }
+
+    }
+
+  }
+
+  if(! loaded) {
+
+    _endStage(false, 0, 0);
+
+    setTempo(last_tempo);
+    _shuffle = last_shuffle;
+
+    return false;
+
+  }
+
+  // trigs, locks and undo belonged to the old notes
+  _endStage(true, offset, offset + _steps);
+  _clearUndo();
+
+  int first = _firstLock(offset);
+  int removed = _firstLock(offset + _steps) - first;
+
+  for(int i = first; i + removed < _lock_count; ++i)
+    _locks[i] = _locks[i + removed];
+
+  _lock_count -= removed;
+
+  // notes that landed on the same step are only stored once
+  if(_removeDuplicates())
+    _heapSort();
+
+  _markAllDirty();
+
+  // save a snapshot of the new sequence
+  if(_journal)
+    _journal->compact();
+
+  return true;
+
+}
+
+// setSysExHandler
+//
+// Allows user to set a callback that will be used to send
+// SysEx pattern dumps with sendDump(). This is separate from
+// the MIDI handler because SysEx messages are longer than
+// the four arguments the MIDI handler supports.
+//
+// @access public
+// @param the callback that will send the SysEx messages
+// @param user data passed to the callback
+// @return void
+//
+void FifteenStep::setSysExHandler(SysExCallback cb, void* context)
+{
+  _sysex_cb = cb;
+  _sysex_context = context;
+}
+
+// sendDump
+//
+// Sends the sequence and settings to the SysEx handler.
+// The data is the same format used by serialize(), split
+// into FS_SYSEX_CHUNK byte groups so each message fits in a
+// single BLE MIDI packet. Each message contains the group
+// index, the total length of the dump, the data packed into
+// seven bit bytes, and an XOR checksum of the packed data.
+//
+// @access public
+// @return int - number of messages sent
+//
+int FifteenStep::sendDump()
+{
+
+  if(! _sysex_cb)
+    return 0;
+
+  FifteenStepSysEx dump = {_sysex_cb, _sysex_context, NULL, 0, 0, {0}, 0};
+
+  // find the length of the dump first, since it
+  // is sent with every message
+  serialize(_sysexCount, &dump);
+
+  // too big for the fourteen bit length
+  if(dump.length > 0x3FFF)
+    return 0;
+
+  serialize(_sysexWrite, &dump);
+
+  // send the last partial group
+  if(dump.count > 0)
+    _sysexSend(&dump);
+
+  return (dump.length + FS_SYSEX_CHUNK - 1) / FS_SYSEX_CHUNK;
+
+}
+
+// receiveSysEx
+//
+// Passes a complete SysEx message received from the MIDI
+// transport to the sequencer. Messages that aren't pattern
+// dumps are ignored. Groups must arrive in order, and the
+// dump is thrown away if a group is missing or fails the
+// checksum. Once the whole dump has arrived, it is loaded
+// at the start of the next loop so the current loop isn't
+// interrupted by half loaded data. If the sequencer isn't
+// running, the dump is loaded right away.
+//
+// @access public
+// @param the SysEx message, including 0xF0 and 0xF7
+// @param length of the message
+// @return bool - true if the message was part of a dump
+//
+bool FifteenStep::receiveSysEx(const byte* data, int length)
+{
+
+  // check that this is one of our dump messages
+  if(length < 11 || data[0] != 0xF0 || data[length - 1] != 0xF7)
+    return false;
+
+  if(data[1] != FS_SYSEX_ID || data[2] != 'F' || data[3] != 0x01)
+    return false;
+
+  unsigned int index = (data[4] << 7) | data[5];
+  unsigned int total = (data[6] << 7) | data[7];
+  int count = length - 11;
+  byte sum = 0;
+
+  for(int i = 8; i < length - 2; ++i)
+    sum ^= data[i];
+
+  // start of a new dump
+  if(index == 0) {
+
+    delete[] _sysex_buffer;
+
+    _sysex_buffer = NULL;
+    _sysex_pending = false;
+
+    // a dump is never longer than the header plus one
+    // lane per note, so don't trust a larger length
+    if(total == 0 || total > 9 + 6UL * _sequence_size)
+      return true;
+
+    _sysex_buffer = new byte[total];
+    _sysex_length = total;
+    _sysex_received = 0;
+
+  }
+
+  // bad checksum, missing group, or we never saw the start
+  if(! _sysex_buffer || (sum & 0x7F) != data[length - 2] || total != _sysex_length ||
+     index * FS_SYSEX_CHUNK != _sysex_received || count > FS_SYSEX_CHUNK ||
+     _sysex_received + count > _sysex_length) {
+
+    delete[] _sysex_buffer;
+
+    _sysex_buffer = NULL;
+    _sysex_pending = false;
+
+    return true;
+
+  }
+
+  // unpack the high bits
+  for(int i = 0; i < count; ++i)
+    _sysex_buffer[_sysex_received++] = data[9 + i] | ((data[8] >> i) & 0x1 ? 0x80 : 0x0);
+
+  if(_sysex_received < _sysex_length)
+    return true;
+
+  _sysex_pending = true;
+
+  if(! _running)
+    _loadSysEx();
+
+  return true;
+
+}
+
+// render
+//
+// Plays the sequence from the start without a wall clock, and
+// passes every MIDI event to the callback along with its exact
+// step and time. The sequencer's own run() logic is used with a
+// virtual clock that jumps straight to the next event, so
+// shuffle, trigs, songs and MIDI clock come out the same as
+// they would live, but thousands of bars can be rendered per
+// second. The step callback isn't called, and the playback
+// position, song position, scheduled events and stats are put
+// back the way they were when the render is done. The random
+// number generator is put back too, so rendering doesn't change
+// which probability trigs play live.
+//
+// @access public
+// @param number of bars of 16 steps to render
+// @param the callback that will receive events
+// @param user data passed to the callback
+// @return unsigned long - number of events rendered
+//
+unsigned long FifteenStep::render(unsigned int bars, RenderCallback cb, void* context)
+{
+
+  if(! cb)
+    return 0;
+
+  // save the live state
+  FifteenStepEvent queue[FS_QUEUE_SIZE];
+  byte queue_count = _queue_count;
+  FifteenStepStats stats = _stats;
+  StepCallback step_cb = _step_cb;
+  StepContextCallback step_context_cb = _step_context_cb;
+  ClockCallback clock_cb = _clock_cb;
+  void* clock_context = _clock_context;
+  bool running = _running;
+  bool on_time = _on_time;
+  bool sysex_pending = _sysex_pending;
+  byte transform_count = _transform_count;
+  FifteenStepTransform transforms[FS_MAX_TRANSFORMS];
+  byte position = _position;
+  byte pattern = _pattern;
+  byte song_index = _song_index;
+  byte song_loops = _song_loops;
+  unsigned int loops = _loops;
+  uint32_t seed = _seed;
+  bool arp_record = _arp_record;
+  bool overdub = _overdub;
+  byte arp_index = _arp_index;
+  byte arp_tick = _arp_tick;
+  byte arp_last = _arp_last;
+  unsigned long next_beat = _next_beat;
+  unsigned long last_beat = _last_beat;
+  unsigned long next_clock = _next_clock;
+  unsigned long last_run = _last_run;
+
+  for(byte i = 0; i < _queue_count; ++i)
+    queue[i] = _queue[i];
+
+  // find where the last step ends
+  unsigned long end = 0;
+  unsigned long steps = (unsigned long) bars * 16;
+  int p = 0;
+
+  for(unsigned long i = 0; i < steps; ++i)
+  {
+    end += _stepLength(p);
+
+    // wrap the same way _step() does, which also
+    // covers a step count that overflowed to zero
+    if(++p >= _steps)
+      p = 0;
+  }
+
+  // start from the top of the song, and let the first
+  // step move the position to zero without wrapping
+  if(_song_length > 0) {
+    _song_index = 0;
+    _song_loops = 0;
+    setPattern(_song[0].pattern);
+  }
+
+  _position = (byte) -1;
+  _loops = 0;
+  _arp_record = false;
+  _arp_last = 0xFF;
+  _overdub = false;
+  _queue_count = 0;
+  _next_beat = 0;
+  _next_clock = 0;
+  _running = true;
+  _sysex_pending = false;
+  for(byte i = 0; i < transform_count; ++i)
+    transforms[i] = _transforms[i];
+
+  _transform_count = 0;
+  _step_cb = NULL;
+  _step_context_cb = NULL;
+  _clock_cb = _renderClock;
+  _clock_context = this;
+  _render_cb = cb;
+  _render_context = context;
+  _render_time = 0;
+  _render_step = 0;
+  _render_count = 0;
+
+  unsigned long played = 0;
+
+  while(_running)
+  {
+
+    // find the next time something will happen
+    unsigned long next = _next_beat;
+
+    if(_next_clock < next)
+      next = _next_clock;
+
+    for(byte i = 0; i < _queue_count; ++i)
+    {
+      if(_queue[i].time < next)
+        next = _queue[i].time;
+    }
+
+    if(next >= end)
+      break;
+
+    _render_time = next;
+
+    // events sent with this step belong to it
+    if(next == _next_beat)
+      _render_step = played++;
+
+    run();
+
+  }
+
+  unsigned long count = _render_count;
+
+  // put the live state back
+  _render_cb = NULL;
+  _render_context = NULL;
+  _clock_cb = clock_cb;
+  _clock_context = clock_context;
+  _step_cb = step_cb;
+  _step_context_cb = step_context_cb;
+  _sysex_pending = sysex_pending;
+  for(byte i = 0; i < transform_count; ++i)
+    _transforms[i] = transforms[i];
+
+  _transform_count = transform_count;
+  _running = running;
+  _on_time = on_time;
+  _position = position;
+  _pattern = pattern;
+  _song_index = song_index;
+  _song_loops = song_loops;
+  _loops = loops;
+  _seed = seed;
+  _arp_record = arp_record;
+  _overdub = overdub;
+  _arp_index = arp_index;
+  _arp_tick = arp_tick;
+  _arp_last = arp_last;
+  _next_beat = next_beat;
+  _last_beat = last_beat;
+  _next_clock = next_clock;
+  _last_run = last_run;
+  _stats = stats;
+  _queue_count = queue_count;
+
+  for(byte i = 0; i < _queue_count; ++i)
+    _queue[i] = queue[i];
+
+  return count;
+
+}
+
+// getSteps
+//
+// Returns the number of 16th note steps
+// in the loop.
+//
+// @access public
+// @return byte - step count
+//
+byte FifteenStep::getSteps()
+{
+  return _steps;
+}
+
+// getPattern
+//
+// Returns the id of the pattern that
+// is currently playing.
+//
+// @access public
+// @return byte - pattern id
+//
+byte FifteenStep::getPattern()
+{
+  return _pattern;
+}
+
+// getSongPosition
+//
+// Returns the index of the song entry
+// that is currently playing.
+//
+// @access public
+// @return byte - song entry index
+//
+byte FifteenStep::getSongPosition()
+{
+  return _song_index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            PRIVATE METHODS                                //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// _init
+//
+// A common init method for the constructors to
+// use when the class is initialized. Lowering the
+// amount of memory the sequencer uses will effect the
+// amount of polyphony the sequencer will support. By
+// default the sequencer allocates 1k of sram.
+//
+// @access private
+// @param the amount of sram to use in bytes
+// @return void
+//
+void FifteenStep::_init(int memory)
+{
+
+  _running = true;
+  _midi_cb = NULL;
+  _step_cb = NULL;
+  _midi_context_cb = NULL;
+  _step_context_cb = NULL;
+  _midi_context = NULL;
+  _step_context = NULL;
+#ifdef FS_BENCHMARK
+  _comparisons = 0;
+#endif
+  _next_beat = 0;
+  _next_clock = 0;
+  _position = 0;
+  _shuffle = 0;
+  _pattern = 0;
+  _patterns = 1;
+  _song = NULL;
+  _song_repeat = true;
+  _song_length = 0;
+  _song_index = 0;
+  _song_loops = 0;
+  _journal = NULL;
+  _clock_cb = NULL;
+  _clock_context = NULL;
+  _trigs = NULL;
+  _trig_count = 0;
+  _locks = NULL;
+  _lock_count = 0;
+  _undo = NULL;
+  _undo_start = 0;
+  _undo_count = 0;
+  _pass_count = 0;
+  _overdub = false;
+  _queue_count = 0;
+  _last_beat = 0;
+  _latency = 0;
+  _microtiming = false;
+  _sysex_cb = NULL;
+  _sysex_context = NULL;
+  _render_cb = NULL;
+  _render_context = NULL;
+  _render_time = 0;
+  _render_step = 0;
+  _render_count = 0;
+  _sysex_buffer = NULL;
+  _sysex_pending = false;
+  _sysex_length = 0;
+  _sysex_received = 0;
+  _sequence_size = memory / sizeof(FifteenStepNote);
+  _sequence = new FifteenStepNote[_sequence_size];
+
+  // set up default notes
+  _resetSequence();
+
+  _on_time = false;
+  _last_run = 0;
+  _edit_depth = 0;
+  _edit_base = 0;
+  _edit_count = 0;
+  _transform_count = 0;
+  _seed = 0x2545F491;
+  _loops = 0;
+  _mute = 0;
+  _solo = 0;
+  _silent = 0;
+  _arp_record = false;
+  _arp_mode = FS_ARP_OFF;
+  _arp_octaves = 1;
+  _arp_division = 1;
+  _arp_channel = 0;
+  _arp_gate = 50;
+  _arp_count = 0;
+  _arp_index = 0;
+  _arp_tick = 0;
+  _arp_velocity = 0;
+  _arp_last = 0xFF;
+  resetStats();
+
+}
+
+// _now
+//
+// Returns the current time in milliseconds from
+// the clock source, or millis() if one isn't set.
+//
+// @access private
+// @return unsigned long
+//
+unsigned long FifteenStep::_now()
+{
+
+  if(_clock_cb)
+    return _clock_cb(_clock_context);
+
+#ifdef ARDUINO
+  return millis();
+#else
+  return 0;
+#endif
+
+}
+
+// _micros
+//
+// Returns the current time in microseconds, used
+// to time calls for the runtime stats. Without
+// micros() the clock source is used instead.
+//
+// @access private
+// @return unsigned long
+//
+unsigned long FifteenStep::_micros()
+{
+
+#ifdef ARDUINO
+  if(! _clock_cb)
+    return micros();
+#endif
+
+  return _now() * 1000;
+
+}
+
+// _shuffleDivision
+//
+// Calculates the size of the shuffle division
+// to use when increasing or decreasing the shuffle
+// amount.
+//
+// @access private
+// @return size of shuffle division
+//
+unsigned long FifteenStep::_shuffleDivision()
+{
+  // split the 16th into 16 parts
+  // so user can change the shuffle
+  return _sixteenth / 16;
+}
+
+// _resetSequence
+//
+// Sets sequence to default state
+//
+// @access private
+// @return void
+void FifteenStep::_resetSequence()
+{
+  // set sequence to default note value
+  for(int i=0; i < _sequence_size; ++i)
+    _sequence[i] = DEFAULT_NOTE;
+
+  // trigs belong to the cleared notes
+  _trig_count = 0;
+
+  // and locks belong to the cleared steps
+  _lock_count = 0;
+
+  // there's nothing left to undo
+  _clearUndo();
+
+  // so do edits that haven't been committed
+  _edit_count = 0;
+
+  // every step needs to be redrawn
+  _markAllDirty();
+}
+
+// _quantizedPosition
+//
+// Returns the closest 16th note to the
+// present time. This is used to see where to
+// save the new note.
+//
+// @access private
+// @return quantized position
+//
+int FifteenStep::_quantizedPosition()
+{
+
+  unsigned long delay;
+
+  return _quantize(_now() * 1000UL, false, delay);
+
+}
+
+// _quantize
+//
+// Finds the step on the shuffled grid for a time in
+// microseconds, using the time the current step started
+// and the length of the steps around it. The time is either
+// moved to the closest step, or to the step at or before it
+// if floor is set. In that case delay is set to the time
+// between the start of the step and the passed time.
+//
+// @access private
+// @param time in microseconds
+// @param use the step at or before the time
+// @param set to the time after the start of the step
+// @return int - position relative to the current pattern
+//
+int FifteenStep::_quantize(unsigned long time, bool floor, unsigned long &delay)
+{
+
+  int previous = _position == 0 ? _steps - 1 : _position - 1;
+  int next = _position + 1 >= _steps ? 0 : _position + 1;
+
+  // time since the current step started
+  long since = (long) (time - _last_beat * 1000UL);
+  long length = _stepLength(_position) * 1000L;
+  long before = _stepLength(previous) * 1000L;
+
+  delay = 0;
+
+  // played before the current step started
+  if(since < 0) {
+
+    if(! floor && -since * 2 < before)
+      return _position;
+
+    if(before + since > 0)
+      delay = before + since;
+
+    return previous;
+
+  }
+
+  if(floor) {
+    delay = since < length ? since : length - 1;
+    return _position;
+  }
+
+  // use current position if below middle point
+  if(since * 2 < length)
+    return _position;
+
+  return next;
+
+}
+
+// _stepLength
+//
+// Returns the length of a step in milliseconds. Shuffle
+// makes even steps longer and odd steps shorter.
+//
+// @access private
+// @param step position
+// @return unsigned long
+//
+unsigned long FifteenStep::_stepLength(int position)
+{
+
+  if((position % 2) == 0)
+    return _sixteenth + _shuffle;
+
+  return _sixteenth - _shuffle;
+
+}
+
+// _step
+//
+// Moves _position forward by one step, calls the
+// step callback with the current & last step position,
+// and triggers any notes at the current position.
+//
+// @access private
+// @return void
+void FifteenStep::_step()
+{
+
+  // save the last position so we
+  // can provide it to the callback
+  int last = _position;
+
+  // increment the position
+  _position++;
+
+  // start over if we've reached the end
+  if(_position >= _steps) {
+    _position = 0;
+    _loops++;
+
+    if(_overdub)
+      _nextPass();
+
+    // run the transforms waiting for the end of the loop
+    // on the pattern that just played, before a song moves on
+    if(_transform_count > 0) {
+      byte count = _transform_count;
+      _transform_count = 0;
+      _runTransform(_transforms, count, _steps - 1);
+    }
+
+    _nextPattern();
+
+    // the song ended, so don't play step 0 again
+    if(! _running)
+      return;
+
+    _loadSysEx();
+  }
+
+  // tell the callback where we are
+  // if it has been set by the sketch
+  if(_step_cb)
+    _step_cb(_position, last);
+  else if(_step_context_cb)
+    _step_context_cb(_step_context, _position, last);
+
+  // trigger next set of notes
+  _triggerNotes();
+
+  if(_arp_mode != FS_ARP_OFF)
+    _arpStep();
+
+}
+
+// _nextPattern
+//
+// Called at the end of every loop. Moves the song
+// forward to the next entry once the current entry
+// has been repeated enough times.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_nextPattern()
+{
+
+  // bail if there isn't a song to play
+  if(_song_length == 0)
+    return;
+
+  _song_loops++;
+
+  // a repeat count of zero plays the pattern once
+  if(_song_loops < _song[_song_index].repeats)
+    return;
+
+  _song_loops = 0;
+  _song_index++;
+
+  if(_song_index >= _song_length) {
+
+    _song_index = 0;
+
+    // stop at the end of the song if we aren't repeating
+    if(! _song_repeat)
+      _running = false;
+
+  }
+
+  setPattern(_song[_song_index].pattern);
+
+}
+
+// _loadSysEx
+//
+// Loads a SysEx dump that has been completely received,
+// and frees the memory used to hold it.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_loadSysEx()
+{
+
+  if(! _sysex_pending)
+    return;
+
+  FifteenStepSysEx check = {NULL, NULL, _sysex_buffer, _sysex_length, 0, {0}, 0};
+  FifteenStepSysEx dump = check;
+  byte header[9];
+
+  // the whole dump is in memory, so it can be checked
+  // before the current notes are cleared to make room
+  if(_readSequence(_sysexRead, &check, header, false)) {
+    _resetSequence();
+    deserialize(_sysexRead, &dump);
+  }
+
+  delete[] _sysex_buffer;
+
+  _sysex_buffer = NULL;
+  _sysex_pending = false;
+
+}
+
+// _offset
+//
+// Returns the first step of the current
+// pattern in the sequence.
+//
+// @access private
+// @return int
+//
+int FifteenStep::_offset()
+{
+  return _pattern * _steps;
+}
+
+// _storeNote
+//
+// Stores or clears a note at the passed position in the
+// sequence, sorts the sequence, and saves the edit to the
+// journal if one is attached. While overdubbing, notes that
+// are already there are left alone, and new notes are added
+// to the undo log.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param velocity of note
+// @param position in sequence
+// @return byte - FS_NOTE_STORED, FS_NOTE_REMOVED, FS_NOTE_DROPPED, FS_NOTE_PENDING or FS_NOTE_IGNORED
+//
+byte FifteenStep::_storeNote(byte channel, byte pitch, byte velocity, int position)
+{
+
+  // don't store notes past the end of the sequence
+  if(position >= FS_MAX_STEPS)
+    return FS_NOTE_IGNORED;
+
+  // overdubs only add notes
+  if(_overdub) {
+
+    if(_findNote(channel, pitch, velocity > 0, position) >= 0)
+      return FS_NOTE_IGNORED;
+
+    _logUndo(channel, pitch, velocity, position);
+
+  }
+
+  if(_edit_depth > 0) {
+
+    // pending edits are stacked downward from the first note
+    if(_edit_count == 0)
+      _edit_base = _sequence_size - _usedSlots();
+
+    // out of free slots, so apply what we have
+    if(_edit_count >= _edit_base) {
+      _applyEdits();
+      _edit_base = _sequence_size - _usedSlots();
+    }
+
+    if(_edit_count < _edit_base) {
+
+      FifteenStepNote &note = _sequence[_edit_base - 1 - _edit_count];
+
+      note.channel = channel;
+      note.pitch = pitch;
+      note.velocity = velocity;
+      note.step = position;
+
+      _edit_count++;
+
+      return FS_NOTE_PENDING;
+
+    }
+
+  }
+
+  byte result = _toggleNote(channel, pitch, velocity, position);
+
+  // nothing changed, so there's nothing to sort or save
+  if(result == FS_NOTE_DROPPED) {
+    _stats.dropped++;
+    return result;
+  }
+
+  _heapSort();
+
+  // track the most slots used at once
+  if(result == FS_NOTE_STORED) {
+
+    int used = _usedSlots();
+
+    if(used > _stats.max_used)
+      _stats.max_used = used;
+
+  }
+
+  // keep a record of the edit if a journal is attached
+  if(_journal)
+    _journal->record(channel, pitch, velocity, position);
+
+  return result;
+
+}
+
+// _toggleNote
+//
+// Stores a note at the passed position in the sequence, or
+// clears it if a matching note is already there. The result
+// doesn't depend on the order of the sequence, and nothing is
+// sorted, so callers that change several notes can sort once
+// when they are done.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param velocity of note
+// @param position in sequence
+// @param first slot to leave alone
+// @param number of slots to leave alone
+// @return byte - FS_NOTE_STORED, FS_NOTE_REMOVED or FS_NOTE_DROPPED
+//
+byte FifteenStep::_toggleNote(byte channel, byte pitch, byte velocity, int position, int skip, int count)
+{
+
+  // this variable allows the loop to track when a note has been removed,
+  // and clears out all existing matching notes
+  bool removed = false;
+  int free = -1;
+
+  for(int i = _sequence_size - 1; i >= 0; i--)
+  {
+
+    // jump over the slots we were asked to leave alone
+    if(i >= skip && i < skip + count) {
+      i = skip;
+      continue;
+    }
+
+    // remember the first free slot in case we need it
+    if(_isEmpty(i)) {
+
+      if(free < 0)
+        free = i;
+
+      continue;
+
+    }
+
+    // used by another step, pitch or channel, keep going
+    if(_sequence[i].pitch != pitch || _sequence[i].step != position || _sequence[i].channel != channel)
+      continue;
+
+    // matching note on or note off, so turn it off
+    if((velocity > 0) == (_sequence[i].velocity > 0)) {
+      _sequence[i] = DEFAULT_NOTE;
+      removed = true;
+    }
+
+  }
+
+  if(removed) {
+
+    // note ons can have trigs
+    if(velocity > 0)
+      _removeTrig(channel, pitch, position);
+
+    _markDirty(position);
+
+    return FS_NOTE_REMOVED;
+
+  }
+
+  // out of memory
+  if(free < 0)
+    return FS_NOTE_DROPPED;
+
+  // use the free slot
+  _sequence[free].channel = channel;
+  _sequence[free].pitch = pitch;
+  _sequence[free].velocity = velocity;
+  _sequence[free].step = position;
+
+  _markDirty(position);
+
+  return FS_NOTE_STORED;
+
+}
+
+// _markDirty
+//
+// Marks a step as changed for nextChange().
+//
+// @access private
+// @param position in sequence
+// @return void
+//
+void FifteenStep::_markDirty(int position)
+{
+  _dirty[position / 8] |= 1 << (position % 8);
+}
+
+// _markAllDirty
+//
+// Marks every step as changed for nextChange().
+//
+// @access private
+// @return void
+//
+void FifteenStep::_markAllDirty()
+{
+  for(int i = 0; i < FS_MAX_STEPS / 8; ++i)
+    _dirty[i] = 0xFF;
+}
+
+// _applyEdits
+//
+// Applies the pending edits in one pass over the notes
+// they touch. The edits are put in order, keeping edits
+// to the same note in the order they were made, and each
+// group of edits to one note is toggled against the
+// sequence. The edits that are left are merged into the
+// free slots in front of the notes, the same way
+// _generate() does. Each edit is added to the journal,
+// unless there isn't room for all of them, in which case
+// a snapshot is written instead.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_applyEdits()
+{
+
+  if(_edit_count == 0)
+    return;
+
+  int first = _edit_base - _edit_count;
+  int last = _edit_base;
+  int end = last;
+  int removed = 0;
+  bool journaled = ! _journal || _journal->_fits(_edit_count);
+
+  // edits are stacked downward, so put the oldest first
+  _reverseSlots(first, last);
+
+  // there are only a few edits, and they are usually
+  // made in step order, so an insertion sort is quick
+  for(int i = first + 1; i < last; ++i)
+  {
+
+    FifteenStepNote note = _sequence[i];
+    int j = i;
+
+    for(; j > first && _compareEdits(_sequence[j - 1], note) > 0; --j)
+      _sequence[j] = _sequence[j - 1];
+
+    _sequence[j] = note;
+
+  }
+
+  for(int i = first; i < last;)
+  {
+
+    FifteenStepNote edit = _sequence[i];
+    bool on = edit.velocity > 0;
+    bool existing = false;
+    int group = i + 1;
+
+    while(group < last && _compareEdits(_sequence[group], edit) == 0)
+      group++;
+
+    // the first edit to a note that is there removes it
+    for(int s = _firstAt(edit.step); s < _sequence_size && _sequence[s].step == edit.step; ++s)
+    {
+
+      FifteenStepNote &note = _sequence[s];
+
+      if(note.channel != edit.channel || note.pitch != edit.pitch || (note.velocity > 0) != on)
+        continue;
+
+      // marked, so the binary search still works
+      note.channel |= 0x80;
+      existing = true;
+      removed++;
+
+      if(s >= end)
+        end = s + 1;
+
+    }
+
+    if(existing && on)
+      _removeTrig(edit.channel, edit.pitch, edit.step);
+
+    // the rest of the edits take turns adding and removing
+    // the note, so only the last one can be left
+    int toggles = group - i - (existing ? 1 : 0);
+
+    for(int g = i; g < group; ++g)
+    {
+
+      if(_journal && journaled)
+        _journal->record(_sequence[g].channel, _sequence[g].pitch, _sequence[g].velocity, _sequence[g].step);
+
+      if(g < group - 1 || toggles % 2 == 0)
+        _sequence[g].channel |= 0x80;
+
+    }
+
+    _markDirty(edit.step);
+
+    i = group;
+
+  }
+
+  // the edits that are left go to the start of the sequence
+  int added = 0;
+
+  for(int i = first; i < last; ++i)
+  {
+    if(! (_sequence[i].channel & 0x80))
+      _sequence[added++] = _sequence[i];
+  }
+
+  for(int i = added; i < last; ++i)
+    _sequence[i] = DEFAULT_NOTE;
+
+  // the notes after the last removed slot don't move
+  int write = end - 1;
+
+  for(int read = end - 1; read >= last; --read)
+  {
+    if(! (_sequence[read].channel & 0x80))
+      _sequence[write--] = _sequence[read];
+  }
+
+  for(; write >= last; --write)
+    _sequence[write] = DEFAULT_NOTE;
+
+  _edit_count = 0;
+
+  int used = _sequence_size - last - removed + added;
+  int free = _sequence_size - used;
+
+  if(added > free) {
+
+    // the sequence is almost full, so there isn't room
+    // to merge, and the new notes are sorted in instead
+    for(int i = added - 1; i >= 0; --i)
+      _sequence[free + i] = _sequence[i];
+
+    for(int i = 0; i < free; ++i)
+      _sequence[i] = DEFAULT_NOTE;
+
+    _heapSort();
+
+  } else if(added > 0) {
+
+    // merge into the free slots in front of the notes, which
+    // never writes over a note or an edit that hasn't been read
+    int read = free + added;
+    int write = free;
+
+    for(int i = 0; i < added; ++i)
+    {
+
+      while(read < _sequence_size && _compare(_sequence[read], _sequence[i]) < 0)
+        _sequence[write++] = _sequence[read++];
+
+      _sequence[write++] = _sequence[i];
+
+    }
+
+    for(int i = 0; i < added; ++i)
+      _sequence[i] = DEFAULT_NOTE;
+
+  }
+
+  if(used > _stats.max_used)
+    _stats.max_used = used;
+
+  if(! journaled)
+    _journal->compact();
+
+}
+
+// _compareEdits
+//
+// Compares two edits by step, channel, pitch and whether
+// they are a note on or off. Edits that compare equal
+// toggle the same note.
+//
+// @access private
+// @param first note
+// @param second note
+// @return int - positive if the first note sorts after the second,
+//         negative if it sorts before, and zero if they match
+//
+int FifteenStep::_compareEdits(const FifteenStepNote &first, const FifteenStepNote &second)
+{
+
+  if(first.step != second.step)
+    return first.step > second.step ? 1 : -1;
+
+  if(first.channel != second.channel)
+    return first.channel > second.channel ? 1 : -1;
+
+  if(first.pitch != second.pitch)
+    return first.pitch > second.pitch ? 1 : -1;
+
+  if((first.velocity > 0) != (second.velocity > 0))
+    return first.velocity > 0 ? 1 : -1;
+
+  return 0;
+
+}
+
+// _queueTransform
+//
+// Runs a pattern transform now, or keeps it until the
+// end of the loop. Transforms that wait are run in the
+// order they were asked for, and a transform that runs
+// now leaves the waiting ones alone.
+//
+// @access private
+// @param transform type
+// @param amount for the transform
+// @param MIDI channel or FS_ANY_CHANNEL
+// @param true to wait for the end of the loop
+// @return bool - false if too many transforms are waiting
+//
+bool FifteenStep::_queueTransform(byte type, int amount, byte channel, bool atLoop)
+{
+
+  FifteenStepTransform transform = {type, channel, amount};
+
+  // nothing is playing, so there's no loop to wait for
+  if(! atLoop || ! _running) {
+    _runTransform(&transform, 1, _position);
+    return true;
+  }
+
+  if(_transform_count >= FS_MAX_TRANSFORMS)
+    return false;
+
+  _transforms[_transform_count++] = transform;
+
+  return true;
+
+}
+
+// _runTransform
+//
+// Runs a list of pattern transforms in order. The
+// last step is the last one that was played, and is
+// used to find the notes that are still sounding.
+//
+// @access private
+// @param transforms to run
+// @param number of transforms
+// @param last step played
+// @return void
+//
+void FifteenStep::_runTransform(FifteenStepTransform* transforms, byte count, int last)
+{
+
+  if(count == 0)
+    return;
+
+  // the transforms rely on the sequence being in order
+  if(_edit_count > 0)
+    _applyEdits();
+
+  for(byte i = 0; i < count; ++i)
+  {
+
+    FifteenStepTransform &transform = transforms[i];
+
+    // notes that change pitch or move need their note offs now
+    if(transform.type != FS_TRANSFORM_VELOCITY)
+      _releaseNotes(transform.type == FS_TRANSFORM_TRANSPOSE ? transform.channel : FS_ANY_CHANNEL, last);
+
+    if(transform.type == FS_TRANSFORM_TRANSPOSE)
+      _transposeNotes(transform.amount, transform.channel);
+    else if(transform.type == FS_TRANSFORM_ROTATE)
+      _rotateNotes(transform.amount);
+    else if(transform.type == FS_TRANSFORM_REVERSE)
+      _reverseNotes();
+    else if(transform.type == FS_TRANSFORM_VELOCITY)
+      _scaleNotes(transform.amount, transform.channel);
+
+  }
+
+  // the logged notes have moved
+  _clearUndo();
+
+  _markAllDirty();
+
+  if(_journal)
+    _journal->compact();
+
+}
+
+// _releaseNotes
+//
+// Turns off the notes in the current pattern that are
+// sounding, so a transform doesn't leave them stuck. The
+// pattern is walked once in the order it plays, ending on
+// the last step played, and the notes that are still held
+// at the end are the ones sounding. Only FS_HELD_NOTES
+// notes are tracked, so if more are held, the oldest is
+// turned off early. Note ons and ratchets that are waiting
+// in the queue are dropped, since their note offs are
+// about to move.
+//
+// @access private
+// @param MIDI channel or FS_ANY_CHANNEL
+// @param last step played
+// @return void
+//
+void FifteenStep::_releaseNotes(byte channel, int last)
+{
+
+  if(! _running || ! _hasOutput() || _steps == 0)
+    return;
+
+  byte q = 0;
+
+  while(q < _queue_count)
+  {
+
+    FifteenStepEvent &event = _queue[q];
+
+    if(event.command != 0x9 || (channel != FS_ANY_CHANNEL && event.channel != channel)) {
+      q++;
+      continue;
+    }
+
+    // a ratchet has already played its first note
+    if(event.repeats > 0)
+      _send(event.channel, 0x8, event.arg1, 0);
+
+    event = _queue[--_queue_count];
+
+  }
+
+  int offset = _offset();
+  int first = _firstAt(offset);
+  int end = _firstAt(offset + _steps);
+  int split = _firstAt(offset + last + 1);
+  int held[FS_HELD_NOTES];
+  byte count = 0;
+
+  // start after the last step played and wrap around
+  for(int n = 0; n < end - first; ++n)
+  {
+
+    int i = split + n < end ? split + n : split + n - (end - first);
+    FifteenStepNote &note = _sequence[i];
+
+    if(channel != FS_ANY_CHANNEL && note.channel != channel)
+      continue;
+
+    // a newer event for the same note replaces the held one
+    for(byte h = 0; h < count; ++h)
+    {
+
+      FifteenStepNote &on = _sequence[held[h]];
+
+      if(on.channel != note.channel || on.pitch != note.pitch)
+        continue;
+
+      for(byte k = h + 1; k < count; ++k)
+        held[k - 1] = held[k];
+
+      count--;
+      break;
+
+    }
+
+    if(note.velocity == 0)
+      continue;
+
+    // out of room, so turn the oldest note off now
+    if(count == FS_HELD_NOTES) {
+
+      _send(_sequence[held[0]].channel, 0x8, _sequence[held[0]].pitch, 0);
+
+      for(byte k = 1; k < count; ++k)
+        held[k - 1] = held[k];
+
+      count--;
+
+    }
+
+    held[count++] = i;
+
+  }
+
+  for(byte h = 0; h < count; ++h)
+    _send(_sequence[held[h]].channel, 0x8, _sequence[held[h]].pitch, 0);
+
+}
+
+// _transposeNotes
+//
+// Moves the pitch of the notes in the current pattern.
+// Every note on a channel moves by the same amount, so
+// the notes on each step stay in order.
+//
+// @access private
+// @param semitones to move
+// @param MIDI channel or FS_ANY_CHANNEL
+// @return void
+//
+void FifteenStep::_transposeNotes(int semitones, byte channel)
+{
+
+  int offset = _offset();
+  int end = _firstAt(offset + _steps);
+  bool removed = false;
+
+  for(int i = _firstAt(offset); i < end; ++i)
+  {
+
+    if(channel != FS_ANY_CHANNEL && _sequence[i].channel != channel)
+      continue;
+
+    int pitch = _sequence[i].pitch + semitones;
+
+    // out of range, so the note is dropped
+    if(pitch < 0 || pitch > 127) {
+      _sequence[i] = DEFAULT_NOTE;
+      removed = true;
+      continue;
+    }
+
+    _sequence[i].pitch = pitch;
+
+  }
+
+  // trigs follow their notes
+  for(int i = _trig_count - 1; i >= 0; --i)
+  {
+
+    if(_trigs[i].step < offset || _trigs[i].step >= offset + _steps)
+      continue;
+
+    if(channel != FS_ANY_CHANNEL && _trigs[i].channel != channel)
+      continue;
+
+    int pitch = _trigs[i].pitch + semitones;
+
+    if(pitch < 0 || pitch > 127)
+      _trigs[i] = _trigs[--_trig_count];
+    else
+      _trigs[i].pitch = pitch;
+
+  }
+
+  if(removed)
+    _packSlots(_sequence_size);
+
+}
+
+// _rotateNotes
+//
+// Shifts the notes in the current pattern. The notes that
+// wrap around to the start are a block at the end of the
+// pattern, so the pattern is put back in order by swapping
+// the two blocks with three reversals.
+//
+// @access private
+// @param steps to shift
+// @return void
+//
+void FifteenStep::_rotateNotes(int steps)
+{
+
+  if(_steps == 0)
+    return;
+
+  int shift = ((steps % _steps) + _steps) % _steps;
+
+  if(shift == 0)
+    return;
+
+  int offset = _offset();
+  int first = _firstAt(offset);
+  int split = _firstAt(offset + _steps - shift);
+  int end = _firstAt(offset + _steps);
+
+  for(int i = first; i < end; ++i)
+    _sequence[i].step = offset + (_sequence[i].step - offset + shift) % _steps;
+
+  for(byte i = 0; i < _trig_count; ++i)
+  {
+    if(_trigs[i].step >= offset && _trigs[i].step < offset + _steps)
+      _trigs[i].step = offset + (_trigs[i].step - offset + shift) % _steps;
+  }
+
+  for(byte i = 0; i < _lock_count; ++i)
+  {
+    if(_locks[i].step >= offset && _locks[i].step < offset + _steps)
+      _locks[i].step = offset + (_locks[i].step - offset + shift) % _steps;
+  }
+
+  _sortLocks();
+
+  // move the wrapped block to the front
+  _reverseSlots(first, end);
+  _reverseSlots(first, first + end - split);
+  _reverseSlots(first + end - split, end);
+
+}
+
+// _reverseNotes
+//
+// Reverses the current pattern. Each note on is matched
+// with its note off, and the two swap velocities, so the
+// old note off becomes the start of the note. Then every
+// event is mirrored around the start of the pattern. The
+// mirrored steps are the old steps in reverse, so the
+// pattern is put back in order by reversing it, reversing
+// each step back, and fixing the note ons and offs that
+// swapped places. The high bit of the channel marks notes
+// and trigs that have already been matched.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_reverseNotes()
+{
+
+  int offset = _offset();
+  int first = _firstAt(offset);
+  int end = _firstAt(offset + _steps);
+  int held[FS_HELD_NOTES];
+  byte count = 0;
+
+  // match note ons with their note offs, going around
+  // twice for notes that wrap past the end of the pattern
+  for(int pass = 0; pass < 2; ++pass)
+  {
+
+    for(int i = first; i < end; ++i)
+    {
+
+      FifteenStepNote &note = _sequence[i];
+
+      if(note.channel & 0x80)
+        continue;
+
+      if(note.velocity > 0) {
+
+        // only look for new note ons the first time around
+        if(pass > 0)
+          continue;
+
+        // forget the oldest note if we are out of room
+        if(count == FS_HELD_NOTES) {
+          for(byte h = 1; h < count; ++h)
+            held[h - 1] = held[h];
+          count--;
+        }
+
+        held[count++] = i;
+        continue;
+
+      }
+
+      for(byte h = 0; h < count; ++h)
+      {
+
+        FifteenStepNote &on = _sequence[held[h]];
+
+        if(on.channel != note.channel || on.pitch != note.pitch)
+          continue;
+
+        int step = offset + (_steps - (note.step - offset)) % _steps;
+
+        // move the trig to where the note will start
+        for(byte t = 0; t < _trig_count; ++t)
+        {
+          if(_trigs[t].channel == on.channel && _trigs[t].pitch == on.pitch && _trigs[t].step == on.step) {
+            _trigs[t].step = step;
+            _trigs[t].channel |= 0x80;
+            break;
+          }
+        }
+
+        note.velocity = on.velocity;
+        on.velocity = 0;
+        note.channel |= 0x80;
+        on.channel |= 0x80;
+
+        for(byte k = h + 1; k < count; ++k)
+          held[k - 1] = held[k];
+
+        count--;
+        break;
+
+      }
+
+    }
+
+  }
+
+  // mirror every event and clear the marks
+  for(int i = first; i < end; ++i)
+  {
+    _sequence[i].channel &= 0x7F;
+    _sequence[i].step = offset + (_steps - (_sequence[i].step - offset)) % _steps;
+  }
+
+  for(byte t = 0; t < _trig_count; ++t)
+  {
+
+    if(_trigs[t].channel & 0x80) {
+      _trigs[t].channel &= 0x7F;
+      continue;
+    }
+
+    if(_trigs[t].step >= offset && _trigs[t].step < offset + _steps)
+      _trigs[t].step = offset + (_steps - (_trigs[t].step - offset)) % _steps;
+
+  }
+
+  for(byte i = 0; i < _lock_count; ++i)
+  {
+    if(_locks[i].step >= offset && _locks[i].step < offset + _steps)
+      _locks[i].step = offset + (_steps - (_locks[i].step - offset)) % _steps;
+  }
+
+  _sortLocks();
+
+  // the first step stays first, and the rest are reversed
+  int start = first;
+
+  while(start < end && _sequence[start].step == offset)
+    start++;
+
+  _reverseSlots(start, end);
+
+  // put the notes on each step back in order
+  for(int i = start; i < end;)
+  {
+
+    int j = i;
+
+    while(j < end && _sequence[j].step == _sequence[i].step)
+      j++;
+
+    _reverseSlots(i, j);
+    i = j;
+
+  }
+
+  // notes of the same pitch on one step may have swapped
+  // velocities, so they only need to move a slot or two
+  for(int i = first + 1; i < end; ++i)
+  {
+    for(int j = i; j > first && _greater(j - 1, j) == j - 1; --j)
+      _reverseSlots(j - 1, j + 1);
+  }
+
+}
+
+// _scaleNotes
+//
+// Scales the velocity of the note ons in the current
+// pattern. Note ons stay note ons, so the notes on each
+// step stay in order.
+//
+// @access private
+// @param percent to scale by
+// @param MIDI channel or FS_ANY_CHANNEL
+// @return void
+//
+void FifteenStep::_scaleNotes(int percent, byte channel)
+{
+
+  int offset = _offset();
+  int end = _firstAt(offset + _steps);
+
+  for(int i = _firstAt(offset); i < end; ++i)
+  {
+
+    if(_sequence[i].velocity == 0)
+      continue;
+
+    if(channel != FS_ANY_CHANNEL && _sequence[i].channel != channel)
+      continue;
+
+    long velocity = (long) _sequence[i].velocity * percent / 100;
+
+    if(velocity < 1)
+      velocity = 1;
+    else if(velocity > 127)
+      velocity = 127;
+
+    _sequence[i].velocity = velocity;
+
+  }
+
+}
+
+// _reverseSlots
+//
+// Reverses the order of a range of slots.
+//
+// @access private
+// @param first slot
+// @param slot after the last slot
+// @return void
+//
+void FifteenStep::_reverseSlots(int first, int last)
+{
+
+  for(last--; first < last; first++, last--)
+  {
+    FifteenStepNote tmp = _sequence[first];
+    _sequence[first] = _sequence[last];
+    _sequence[last] = tmp;
+  }
+
+}
+
+// _packSlots
+//
+// Moves empty slots back to the start of the sequence
+// without changing the order of the notes. Only the
+// slots before end are moved, so if the last empty
+// slot is known, the rest of the sequence is left
+// alone.
+//
+// @access private
+// @param slot after the last slot that could be empty
+// @return void
+//
+void FifteenStep::_packSlots(int end)
+{
+
+  int write = end - 1;
+
+  for(int read = end - 1; read >= 0; --read)
+  {
+    if(! _isEmpty(read))
+      _sequence[write--] = _sequence[read];
+  }
+
+  for(; write >= 0; --write)
+    _sequence[write] = DEFAULT_NOTE;
+
+}
+
+// _generate
+//
+// Replaces every note of one channel and pitch in the current
+// pattern with a note on each step set in a bit field. The old
+// notes are cleared and packed, then the new notes are merged
+// in one pass. Empty slots sort to the start, so the merge
+// starts in the free slots and moves forward, and it never
+// writes over a note it hasn't read yet. If there isn't room
+// for every hit, the last hits are dropped.
+//
+// @access private
+// @param bit field of hits, one bit per step
+// @param MIDI channel
+// @param pitch of note
+// @param velocity of note
+// @param length of each note in steps
+// @return int - number of hits stored
+//
+int FifteenStep::_generate(byte* hits, byte channel, byte pitch, byte velocity, byte length)
+{
+
+  int offset = _offset();
+  int end = _firstAt(offset + _steps);
+  bool removed = false;
+  int count = 0;
+
+  if(_edit_count > 0) {
+    _applyEdits();
+    end = _firstAt(offset + _steps);
+  }
+
+  if(velocity == 0)
+    velocity = 1;
+
+  if(length == 0)
+    length = 1;
+
+  if(length > _steps)
+    length = _steps;
+
+  // clear the old notes
+  for(int i = _firstAt(offset); i < end; ++i)
+  {
+    if(_sequence[i].channel == channel && _sequence[i].pitch == pitch) {
+      _removeTrig(channel, pitch, _sequence[i].step);
+      _sequence[i] = DEFAULT_NOTE;
+      removed = true;
+    }
+  }
+
+  if(removed)
+    _packSlots(_sequence_size);
+
+  int free = _sequence_size - _usedSlots();
+
+  for(int i = 0; i < _steps; ++i)
+  {
+
+    if(! (hits[i >> 3] & (1 << (i & 7))))
+      continue;
+
+    // each hit needs a note on and a note off
+    if(count * 2 + 2 > free) {
+      hits[i >> 3] &= ~(1 << (i & 7));
+      _stats.dropped++;
+      continue;
+    }
+
+    count++;
+
+  }
+
+  // merge into the free slots in front of the notes
+  int read = free;
+  int write = read - count * 2;
+
+  for(int i = 0; i < _steps; ++i)
+  {
+
+    int start = (i - length + _steps) % _steps;
+    byte velocities[2];
+    byte total = 0;
+
+    // note offs sort before note ons on the same step
+    if(hits[start >> 3] & (1 << (start & 7)))
+      velocities[total++] = 0;
+
+    if(hits[i >> 3] & (1 << (i & 7)))
+      velocities[total++] = velocity;
+
+    for(byte e = 0; e < total; ++e)
+    {
+
+      FifteenStepNote note = {channel, pitch, velocities[e], (byte) (offset + i)};
+
+      while(read < _sequence_size && _compare(_sequence[read], note) < 0)
+        _sequence[write++] = _sequence[read++];
+
+      _sequence[write++] = note;
+
+    }
+
+  }
+
+  // the notes after the pattern are already in place
+  int used = _usedSlots();
+
+  if(used > _stats.max_used)
+    _stats.max_used = used;
+
+  // the logged notes may have been replaced
+  _clearUndo();
+
+  _markAllDirty();
+
+  if(_journal)
+    _journal->compact();
+
+  return count;
+
+}
+
+// _random
+//
+// Returns the next number from a 32 bit xorshift
+// generator. It is fast on 8 bit chips and gives
+// the same numbers on the host as on the board.
+//
+// @access private
+// @return uint32_t
+//
+uint32_t FifteenStep::_random()
+{
+
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+
+  return _seed;
+
+}
+
+// _isEmpty
+//
+// Checks if the slot at the passed index
+// is in the default state.
+//
+// @access private
+// @param index in the sequence
+// @return bool
+//
+bool FifteenStep::_isEmpty(int i)
+{
+
+  return _sequence[i].pitch == 0 && _sequence[i].velocity == 0 &&
+         _sequence[i].step == 0 && _sequence[i].channel == 0;
+
+}
+
+// _usedSlots
+//
+// Returns the number of slots in the sequence that hold
+// notes. Empty slots sort to the start of the sequence,
+// so the first used slot can be found with a binary search.
+//
+// @access private
+// @return int
+//
+int FifteenStep::_usedSlots()
+{
+
+  // pending edits are kept in free slots below the notes
+  if(_edit_count > 0)
+    return _sequence_size - _edit_base;
+
+  int low = 0;
+  int high = _sequence_size;
+
+  while(low < high)
+  {
+
+    int middle = (low + high) / 2;
+
+    if(_isEmpty(middle))
+      low = middle + 1;
+    else
+      high = middle;
+
+  }
+
+  return _sequence_size - low;
+
+}
+
+// _firstAt
+//
+// Returns the index of the first note at or after the
+// passed position. Empty slots sort to the start of the
+// sequence, followed by notes in step order, so this is
+// a binary search.
+//
+// @access private
+// @param position in sequence
+// @return int - index, or the sequence size if there isn't one
+//
+int FifteenStep::_firstAt(int position)
+{
+
+  // skip over pending edits
+  int low = _edit_count > 0 ? _edit_base : 0;
+  int high = _sequence_size;
+
+  while(low < high)
+  {
+
+    int middle = (low + high) / 2;
+
+    if(_isEmpty(middle) || _sequence[middle].step < position)
+      low = middle + 1;
+    else
+      high = middle;
+
+  }
+
+  return low;
+
+}
+
+// _laneKey
+//
+// Returns the key of the lane a note belongs to. Lanes
+// are notes that share the same channel, pitch and
+// velocity, and are stored together by serialize().
+//
+// @access private
+// @param note
+// @return long - lane key
+//
+long FifteenStep::_laneKey(const FifteenStepNote &note)
+{
+
+  return ((long) note.channel << 16) | ((long) note.pitch << 8) | note.velocity;
+
+}
+
+// _laneEnd
+//
+// Returns the position after the last note of the lane
+// that starts at the passed position. The sequence must
+// be sorted by lane.
+//
+// @access private
+// @param first position of the lane
+// @return int - position after the lane
+//
+int FifteenStep::_laneEnd(int start)
+{
+
+  long key = _laneKey(_sequence[start]);
+  int end = start + 1;
+
+  while(end < _sequence_size && _laneKey(_sequence[end]) == key)
+    end++;
+
+  return end;
+
+}
+
+// _laneRuns
+//
+// Walks the steps of a lane and groups them into runs
+// of equal step deltas. The runs are written to the
+// passed buffer as delta and count pairs if it is set.
+// The sequence must be sorted by lane.
+//
+// @access private
+// @param first position of the lane
+// @param position after the lane
+// @param buffer to write runs to, or NULL to only count
+// @return byte - number of runs in the lane
+//
+byte FifteenStep::_laneRuns(int start, int end, FifteenStepBuffer* out)
+{
+
+  int last = 0;
+  int delta = -1;
+  byte count = 0;
+  byte runs = 0;
+
+  for(int i = start; i < end; ++i)
+  {
+
+    int d = _sequence[i].step - last;
+    last = _sequence[i].step;
+
+    // extend the current run if the spacing matches
+    if(d == delta && count < 255) {
+      count++;
+      continue;
+    }
+
+    if(count > 0) {
+
+      if(out) {
+        out->put(delta);
+        out->put(count);
+      }
+
+      runs++;
+
+    }
+
+    delta = d;
+    count = 1;
+
+  }
+
+  if(count > 0) {
+
+    if(out) {
+      out->put(delta);
+      out->put(count);
+    }
+
+    runs++;
+
+  }
+
+  return runs;
+
+}
+
+// _readSequence
+//
+// Reads a sequence saved with serialize(). If stage is
+// true, the notes are staged in the free slots with
+// _stageNote(), and the notes already in the sequence are
+// left alone. Otherwise the data is only checked, so a
+// source that can be read again can be checked before the
+// current notes are cleared to make room for it.
+//
+// @access private
+// @param callback that will supply the data
+// @param user data passed to the callback
+// @param nine bytes to copy the header into
+// @param true to stage the notes
+// @return bool - false if the data is cut short or the notes don't fit
+//
+bool FifteenStep::_readSequence(ReadCallback cb, void* context, byte* header, bool stage)
+{
+
+  FifteenStepBuffer in = {NULL, cb, context, {0}, 0, 0, 0};
+
+  for(byte i = 0; i < 9; ++i)
+  {
+    if(! in.get(header[i]))
+      return false;
+  }
+
+  // make sure this is something we know how to load
+  if(header[0] != 'F' || header[1] != 'S')
+    return false;
+
+  if(header[2] == 0 || header[2] > FS_FORMAT_VERSION)
+    return false;
+
+  int lanes = (header[7] << 8) | header[8];
+  int slot = 0;
+  int count = 0;
+
+  for(int lane = 0; lane < lanes; ++lane)
+  {
+
+    FifteenStepNote note;
+    byte runs;
+
+    if(! in.get(note.channel) || ! in.get(note.pitch) || ! in.get(note.velocity) || ! in.get(runs))
+      return false;
+
+    int step = 0;
+
+    for(byte run = 0; run < runs; ++run)
+    {
+
+      byte delta, total;
+
+      if(! in.get(delta) || ! in.get(total))
+        return false;
+
+      for(byte n = 0; n < total; ++n)
+      {
+
+        step += delta;
+        note.step = step;
+
+        if(step >= FS_MAX_STEPS)
+          return false;
+
+        // only the free slots are used while staging
+        if(stage && ! _stageNote(slot, note))
+          return false;
+
+        if(++count > _sequence_size)
+          return false;
+
+      }
+
+    }
+
+  }
+
+  return true;
+
+}
+
+// _stageNote
+//
+// Stores a note that is being loaded in a free slot,
+// without touching the notes already in the sequence, so
+// a load that fails part way through can be thrown away.
+// Loaded notes are marked with the high bit of the channel.
+//
+// @access private
+// @param slot to start looking from, moved past the used slot
+// @param the note to store
+// @return bool - false if there aren't any free slots left
+//
+bool FifteenStep::_stageNote(int &slot, FifteenStepNote note)
+{
+
+  // empty slots sort to the start of the sequence
+  if(slot >= _sequence_size || ! _isEmpty(slot))
+    return false;
+
+  note.channel |= 0x80;
+  _sequence[slot++] = note;
+
+  return true;
+
+}
+
+// _endStage
+//
+// Finishes a load started with _stageNote. If the load is
+// kept, the notes between the first and last step are
+// replaced with the loaded notes. Otherwise the loaded
+// notes are removed and the sequence is left as it was.
+//
+// @access private
+// @param true to keep the loaded notes
+// @param first step being replaced
+// @param step after the last step being replaced
+// @return void
+//
+void FifteenStep::_endStage(bool keep, int first, int last)
+{
+
+  for(int i = 0; i < _sequence_size; ++i)
+  {
+
+    if(_isEmpty(i))
+      continue;
+
+    if(_sequence[i].channel & 0x80) {
+
+      if(keep)
+        _sequence[i].channel &= 0x7F;
+      else
+        _sequence[i] = DEFAULT_NOTE;
+
+    } else if(keep && _sequence[i].step >= first && _sequence[i].step < last) {
+      _removeTrig(_sequence[i].channel, _sequence[i].pitch, _sequence[i].step);
+      _sequence[i] = DEFAULT_NOTE;
+    }
+
+  }
+
+  _heapSort();
+
+}
+
+// _midiTrack
+//
+// Writes the events of one Standard MIDI File track to
+// the passed buffer. The current pattern is walked once,
+// or every entry of the song if one has been set. Note
+// offs are written before note ons on the same step so
+// retriggered notes aren't cut short.
+//
+// @access private
+// @param buffer to write the track to
+// @param bit mask of the channels to include
+// @param include the tempo meta event
+// @return void
+//
+void FifteenStep::_midiTrack(FifteenStepBuffer &out, unsigned int channels, bool tempo)
+{
+
+  unsigned long sixteenth = FS_MIDI_PPQ / 4;
+  unsigned long shuffle = _shuffle * sixteenth / _sixteenth;
+  unsigned long loop = _stepTicks(_steps, sixteenth, shuffle);
+  unsigned long start = 0;
+  unsigned long last = 0;
+
+  if(tempo) {
+
+    // microseconds per quarter note
+    unsigned long us = 60000000UL / _tempo;
+
+    out.putVariable(0);
+    out.put(0xFF);
+    out.put(0x51);
+    out.put(0x03);
+    out.put((us >> 16) & 0xFF);
+    out.put((us >> 8) & 0xFF);
+    out.put(us & 0xFF);
+
+  }
+
+  byte entries = _song_length > 0 ? _song_length : 1;
+
+  for(byte e = 0; e < entries; ++e)
+  {
+
+    byte pattern = _song_length > 0 ? _song[e].pattern : _pattern;
+    byte repeats = _song_length > 0 ? _song[e].repeats : 1;
+
+    if(repeats == 0)
+      repeats = 1;
+
+    for(byte r = 0; r < repeats; ++r)
+    {
+
+      for(int step = 0; step < _steps; ++step)
+      {
+
+        int position = pattern * _steps + step;
+        unsigned long time = start + _stepTicks(step, sixteenth, shuffle);
+
+        // note offs on the first pass, note ons on the second
+        for(byte pass = 0; pass < 2; ++pass)
+        {
+
+          // notes are sorted by step, so only this step is walked
+          for(int i = _firstAt(position); i < _sequence_size && _sequence[i].step == position; ++i)
+          {
+
+            if((_sequence[i].velocity > 0) != (pass == 1))
+              continue;
+
+            if(! (channels & (1 << (_sequence[i].channel & 0x0F))))
+              continue;
+
+            out.putVariable(time - last);
+            out.put((pass == 1 ? 0x90 : 0x80) | (_sequence[i].channel & 0x0F));
+            out.put(_sequence[i].pitch & 0x7F);
+            out.put(_sequence[i].velocity & 0x7F);
+
+            last = time;
+
+          }
+
+        }
+
+      }
+
+      start += loop;
+
+    }
+
+  }
+
+  // end of track
+  out.putVariable(start - last);
+  out.put(0xFF);
+  out.put(0x2F);
+  out.put(0x00);
+
+}
+
+// _stepTicks
+//
+// Returns the start of the passed step in ticks from the
+// start of the loop. Shuffle delays every odd step, the same
+// way run() lengthens even steps and shortens odd steps.
+//
+// @access private
+// @param step position
+// @param length of a sixteenth note in ticks
+// @param shuffle amount in ticks
+// @return unsigned long
+//
+unsigned long FifteenStep::_stepTicks(int step, unsigned long sixteenth, unsigned long shuffle)
+{
+
+  unsigned long ticks = (unsigned long) (step / 2) * sixteenth * 2;
+
+  if(step % 2)
+    ticks += sixteenth + shuffle;
+
+  return ticks;
+
+}
+
+// _tickToStep
+//
+// Quantizes a time in ticks to a step using the same
+// shuffled grid as _stepTicks. Steps are rounded to the
+// closest step, or up to the next step if requested.
+//
+// @access private
+// @param time in ticks
+// @param length of a sixteenth note in ticks
+// @param shuffle amount in ticks
+// @param round up instead of to the closest step
+// @return int
+//
+int FifteenStep::_tickToStep(unsigned long tick, unsigned long sixteenth, unsigned long shuffle, bool up)
+{
+
+  unsigned long pair = tick / (sixteenth * 2);
+  unsigned long rem = tick % (sixteenth * 2);
+  unsigned long odd = sixteenth + shuffle;
+
+  // way past the end of any pattern
+  if(pair > FS_MAX_STEPS)
+    pair = FS_MAX_STEPS;
+
+  int step = pair * 2;
+
+  if(up) {
+
+    if(rem == 0)
+      return step;
+
+    return rem <= odd ? step + 1 : step + 2;
+
+  }
+
+  if(rem * 2 < odd)
+    return step;
+
+  if(rem * 2 < odd + sixteenth * 2)
+    return step + 1;
+
+  return step + 2;
+
+}
+
+// _removeDuplicates
+//
+// Clears notes that are exact copies of the note before
+// them. The sequence must be sorted before this is called.
+//
+// @access private
+// @return bool - true if any notes were removed
+//
+bool FifteenStep::_removeDuplicates()
+{
+
+  bool removed = false;
+
+  for(int i = _sequence_size - 1; i > 0; --i)
+  {
+
+    if(_isEmpty(i))
+      continue;
+
+    if(_greater(i, i - 1) != -1)
+      continue;
+
+    _sequence[i] = DEFAULT_NOTE;
+    removed = true;
+
+  }
+
+  return removed;
+
 }
 
-// getSequence
+// _findTrig
 //
-// Returns a pointer to the current sequence
+// Returns the trig for a note, or NULL
+// if the note doesn't have one.
 //
 // @access private
-// @return FifteenStepNote*
+// @param channel of note
+// @param pitch of note
+// @param position in sequence
+// @return FifteenStepTrig*
 //
-FifteenStepNote* FifteenStep::getSequence()
+FifteenStepTrig* FifteenStep::_findTrig(byte channel, byte pitch, byte step)
 {
-  return _sequence;
+
+  for(byte i = 0; i < _trig_count; ++i)
+  {
+    if(_trigs[i].step == step && _trigs[i].pitch == pitch && _trigs[i].channel == channel)
+      return &_trigs[i];
+  }
+
+  return NULL;
+
 }
 
-// getPosition
+// _hasNoteOn
 //
-// Returns the closest 16th note to the
-// present time. This is used to see where to
-// save the new note.
+// Checks that a note on is in the sequence, so trigs
+// are only added for notes that will play them. Edits
+// that are waiting are applied first, since the note
+// may be one of them.
 //
-// @access public
-// @return byte - quantized position
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param position in sequence
+// @return bool
 //
-byte FifteenStep::getPosition()
+bool FifteenStep::_hasNoteOn(byte channel, byte pitch, int position)
 {
-  return _quantizedPosition();
+
+  // trigs can't be stored past the end of the sequence
+  if(position >= FS_MAX_STEPS)
+    return false;
+
+  if(_edit_count > 0)
+    _applyEdits();
+
+  return _findNote(channel, pitch, true, position) >= 0;
+
 }
 
-///////////////////////////////////////////////////////////////////////////////
-//                                                                           //
-//                            PRIVATE METHODS                                //
-//                                                                           //
-///////////////////////////////////////////////////////////////////////////////
+// _addTrig
+//
+// Returns the trig for a note, adding a new one with
+// default settings if needed. The trig table is allocated
+// the first time this is called. Returns NULL if the
+// table is full.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param position in sequence
+// @return FifteenStepTrig*
+//
+FifteenStepTrig* FifteenStep::_addTrig(byte channel, byte pitch, byte step)
+{
 
-// _init
+  FifteenStepTrig* trig = _findTrig(channel, pitch, step);
+
+  if(trig)
+    return trig;
+
+  if(! _trigs)
+    _trigs = new FifteenStepTrig[FS_MAX_TRIGS];
+
+  if(_trig_count >= FS_MAX_TRIGS)
+    return NULL;
+
+  trig = &_trigs[_trig_count++];
+
+  trig->channel = channel;
+  trig->pitch = pitch;
+  trig->step = step;
+  trig->timing = 0;
+  trig->probability = 100;
+  trig->condition = FS_TRIG_ALWAYS;
+  trig->ratchet = 0;
+  trig->decay = 0;
+
+  return trig;
+
+}
+
+// _removeTrig
 //
-// A common init method for the constructors to
-// use when the class is initialized. Lowering the
-// amount of memory the sequencer uses will effect the
-// amount of polyphony the sequencer will support. By
-// default the sequencer allocates 1k of sram.
+// Removes the trig for a note if it has one. The
+// last trig is moved into the free spot.
 //
 // @access private
-// @param the amount of sram to use in bytes
+// @param channel of note
+// @param pitch of note
+// @param position in sequence
 // @return void
 //
-void FifteenStep::_init(int memory)
+void FifteenStep::_removeTrig(byte channel, byte pitch, byte step)
 {
 
-  _running = true;
-  _next_beat = 0;
-  _next_clock = 0;
-  _position = 0;
-  _shuffle = 0;
-  _sequence_size = memory / sizeof(FifteenStepNote);
-  _sequence = new FifteenStepNote[_sequence_size];
+  FifteenStepTrig* trig = _findTrig(channel, pitch, step);
 
-  // set up default notes
-  _resetSequence();
+  if(! trig)
+    return;
+
+  *trig = _trigs[--_trig_count];
 
 }
 
-// _shuffleDivision
+// _trimTrig
 //
-// Calculates the size of the shuffle division
-// to use when increasing or decreasing the shuffle
-// amount.
+// Removes a trig that has been set back to the default
+// settings, so it doesn't take up room in the table.
 //
 // @access private
-// @return size of shuffle division
+// @param trig
+// @return void
 //
-unsigned long FifteenStep::_shuffleDivision()
+void FifteenStep::_trimTrig(FifteenStepTrig* trig)
 {
-  // split the 16th into 16 parts
-  // so user can change the shuffle
-  return _sixteenth / 16;
+
+  if(trig->timing > 0 || trig->probability < 100)
+    return;
+
+  if(trig->condition != FS_TRIG_ALWAYS || trig->ratchet > 0)
+    return;
+
+  *trig = _trigs[--_trig_count];
+
 }
 
-// _resetSequence
+// _firstLock
+//
+// Returns the index of the first lock at or after
+// a position, using a binary search.
+//
+// @access private
+// @param position in sequence
+// @return int
+//
+int FifteenStep::_firstLock(int position)
+{
+
+  int low = 0;
+  int high = _lock_count;
+
+  while(low < high)
+  {
+
+    int middle = (low + high) / 2;
+
+    if(_locks[middle].step < position)
+      low = middle + 1;
+    else
+      high = middle;
+
+  }
+
+  return low;
+
+}
+
+// _removeLock
+//
+// Removes a lock from the table and
+// closes the gap so it stays in order.
+//
+// @access private
+// @param index of lock
+// @return void
+//
+void FifteenStep::_removeLock(byte index)
+{
+
+  _lock_count--;
+
+  for(byte i = index; i < _lock_count; ++i)
+    _locks[i] = _locks[i + 1];
+
+}
+
+// _sortLocks
+//
+// Puts the lock table back in order after the steps
+// have been moved by a transform. The table is small
+// and mostly in order, so an insertion sort is used.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_sortLocks()
+{
+
+  for(byte i = 1; i < _lock_count; ++i)
+  {
+
+    FifteenStepLock lock = _locks[i];
+    byte j = i;
+
+    for(; j > 0; --j)
+    {
+
+      FifteenStepLock &prev = _locks[j - 1];
+
+      if(prev.step < lock.step)
+        break;
+
+      if(prev.step == lock.step && (prev.channel < lock.channel || (prev.channel == lock.channel && prev.controller < lock.controller)))
+        break;
+
+      _locks[j] = prev;
+
+    }
+
+    _locks[j] = lock;
+
+  }
+
+}
+
+// _updateSilent
+//
+// Combines the mute and solo masks into one mask of
+// channels that shouldn't be played, so the trigger
+// path only has to test one bit per note.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_updateSilent()
+{
+
+  _silent = _mute;
+
+  if(_solo)
+    _silent |= ~_solo;
+
+}
+
+// _isSilent
+//
+// Checks if a channel is muted, or isn't
+// soloed while another channel is.
+//
+// @access private
+// @param MIDI channel
+// @return bool
+//
+bool FifteenStep::_isSilent(byte channel)
+{
+  return channel < 16 && (_silent & (1 << channel));
+}
+
+// _sendLocks
+//
+// Sends the control changes locked to a step.
+//
+// @access private
+// @param position in sequence
+// @return void
+//
+void FifteenStep::_sendLocks(int position)
+{
+
+  for(int i = _firstLock(position); i < _lock_count && _locks[i].step == position; ++i)
+  {
+    if(! _isSilent(_locks[i].channel))
+      _send(_locks[i].channel, 0xB, _locks[i].controller, _locks[i].value);
+  }
+
+}
+
+// _trigPlays
+//
+// Checks the condition and probability of a trig to see
+// if its note should play on this loop. The condition is
+// checked first so the random number generator only moves
+// forward for notes that could play, and the roll is scaled
+// to a percent with a multiply and shift, which is cheap on
+// 8 bit chips.
+//
+// @access private
+// @param trig
+// @return bool
+//
+bool FifteenStep::_trigPlays(FifteenStepTrig* trig)
+{
+
+  byte condition = trig->condition;
+
+  if(condition == FS_TRIG_FIRST && _loops != 0)
+    return false;
+
+  if(condition == FS_TRIG_NOT_FIRST && _loops == 0)
+    return false;
+
+  // a of b loops
+  if(condition >> 4) {
+    if(_loops % (condition >> 4) != (condition & 0xF))
+      return false;
+  }
+
+  if(trig->probability >= 100)
+    return true;
+
+  byte roll = ((unsigned int) (_random() & 0xFF) * 100) >> 8;
+
+  return roll < trig->probability;
+
+}
+
+// _schedule
+//
+// Adds a MIDI event to the queue so it can be sent by run()
+// at a time in between steps. If the queue is full, the
+// event is sent right away.
+//
+// @access private
+// @param time to send the event
+// @param channel
+// @param command
+// @param first argument
+// @param second argument
+// @return void
+//
+void FifteenStep::_schedule(unsigned long time, byte channel, byte command, byte arg1, byte arg2)
+{
+
+  if(_queue_count >= FS_QUEUE_SIZE) {
+
+    _send(channel, command, arg1, arg2);
+
+    return;
+
+  }
+
+  FifteenStepEvent &event = _queue[_queue_count++];
+
+  event.time = time;
+  event.channel = channel;
+  event.command = command;
+  event.arg1 = arg1;
+  event.arg2 = arg2;
+  event.repeats = 0;
+  event.decay = 0;
+  event.interval = 0;
+
+}
+
+// _runQueue
+//
+// Sends the scheduled events that are due and
+// removes them from the queue. Ratchet events
+// turn their note off and on again, and stay
+// in the queue until they run out of repeats.
+//
+// @access private
+// @param the current time
+// @return void
+//
+void FifteenStep::_runQueue(unsigned long now)
+{
+
+  byte i = 0;
+
+  while(i < _queue_count)
+  {
+
+    FifteenStepEvent &event = _queue[i];
+
+    // not time yet
+    if((long) (now - event.time) < 0) {
+      i++;
+      continue;
+    }
+
+    if(event.repeats > 0)
+      _send(event.channel, 0x8, event.arg1, 0);
+
+    _send(event.channel, event.command, event.arg1, event.arg2);
+
+    if(event.repeats > 0 && --event.repeats > 0) {
+
+      event.time += event.interval;
+      event.arg2 -= (unsigned int) event.arg2 * event.decay / 100;
+
+      if(event.arg2 == 0)
+        event.arg2 = 1;
+
+      i++;
+      continue;
+
+    }
+
+    // fill the gap with the last event
+    event = _queue[--_queue_count];
+
+  }
+
+}
+
+// _cancelRepeats
+//
+// Removes the ratchet events for a note, so repeats
+// that are still waiting don't play after the note
+// has been turned off.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @return void
+//
+void FifteenStep::_cancelRepeats(byte channel, byte pitch)
+{
+
+  byte i = 0;
+
+  while(i < _queue_count)
+  {
+
+    if(_queue[i].repeats > 0 && _queue[i].channel == channel && _queue[i].arg1 == pitch)
+      _queue[i] = _queue[--_queue_count];
+    else
+      i++;
+
+  }
+
+}
+
+// _hasOutput
 //
-// Sets sequence to default state
+// Checks if there is anywhere to send MIDI messages.
 //
 // @access private
-// @return void
-void FifteenStep::_resetSequence()
+// @return bool
+//
+bool FifteenStep::_hasOutput()
 {
-  // set sequence to default note value
-  for(int i=0; i < _sequence_size; ++i)
-    _sequence[i] = DEFAULT_NOTE;
+  return _midi_cb || _midi_context_cb || _render_cb;
 }
 
-// _quantizedPosition
+// _send
 //
-// Returns the closest 16th note to the
-// present time. This is used to see where to
-// save the new note.
+// Sends a MIDI message to the MIDI callback, or to
+// the render callback while a render is running.
 //
 // @access private
-// @return quantized position
+// @param channel
+// @param command
+// @param first argument
+// @param second argument
+// @return void
 //
-int FifteenStep::_quantizedPosition()
+void FifteenStep::_send(byte channel, byte command, byte arg1, byte arg2)
 {
 
-  if(_shuffle > 0)
-    return _position;
+  if(_render_cb) {
 
-  // what's the time?
-  unsigned long now = millis();
+    FifteenStepEvent event;
 
-  // calculate value of 32nd note
-  unsigned long thirty_second = _sixteenth / 2;
+    event.time = _render_time;
+    event.channel = channel;
+    event.command = command;
+    event.arg1 = arg1;
+    event.arg2 = arg2;
+    event.repeats = 0;
+    event.decay = 0;
+    event.interval = 0;
 
-  // use current position if below middle point
-  if(now <= (_next_beat - thirty_second))
-    return _position;
+    _render_count++;
+    _render_cb(_render_context, _render_step, event);
 
-  // return first step if the next step
-  // is past the step count
-  if((_position + 1) >= _steps)
-    return 0;
+    return;
 
-  // return next step
-  return _position + 1;
+  }
+
+  if(_midi_cb)
+    _midi_cb(channel, command, arg1, arg2);
+  else if(_midi_context_cb)
+    _midi_context_cb(_midi_context, channel, command, arg1, arg2);
 
 }
 
-// _step
+// _renderClock
 //
-// Moves _position forward by one step, calls the
-// step callback with the current & last step position,
-// and triggers any notes at the current position.
+// The clock source used by render().
 //
 // @access private
-// @return void
-void FifteenStep::_step()
+// @param the sequencer
+// @return unsigned long - render time
+//
+unsigned long FifteenStep::_renderClock(void* context)
 {
-
-  // save the last position so we
-  // can provide it to the callback
-  int last = _position;
-
-  // increment the position
-  _position++;
-
-  // start over if we've reached the end
-  if(_position >= _steps)
-    _position = 0;
-
-  // tell the callback where we are
-  // if it has been set by the sketch
-  if(_step_cb)
-    _step_cb(_position, last);
-
-  // trigger next set of notes
-  _triggerNotes();
-
+  return ((FifteenStep*) context)->_render_time;
 }
 
 // _tick
@@ -649,11 +5460,11 @@ void FifteenStep::_tick()
 {
 
   // bail if the midi callback isn't set
-  if(! _midi_cb)
+  if(! _hasOutput())
     return;
 
   // tick
-  _midi_cb(0x0, 0xF8, 0x0, 0x0);
+  _send(0x0, 0xF8, 0x0, 0x0);
 
 }
 
@@ -669,31 +5480,34 @@ void FifteenStep::_loopPosition()
 {
 
   // bail if the midi callback isn't set
-  if(! _midi_cb)
+  if(! _hasOutput())
     return;
 
   // send position
-  _midi_cb(0x0, 0xF2, 0x0, _position);
+  _send(0x0, 0xF2, 0x0, _position);
 
 }
 
 // _heapSort
 //
-// Sort the sequence based on the heapsort algorithm
+// Sort the sequence based on the heapsort algorithm.
+// Passing true sorts the notes by lane instead of by
+// step, which is only used while serializing.
 //
 // Based on pseudocode found here: http://en.wikipedia.org/wiki/Heapsort
 //
 // @access private
+// @param sort by lane instead of by step
 // @return void
 //
-void FifteenStep::_heapSort()
+void FifteenStep::_heapSort(bool lanes)
 {
 
   int i;
   FifteenStepNote tmp;
 
   for(i = _sequence_size / 2; i >= 0; i--)
-    _siftDown(i, _sequence_size - 1);
+    _siftDown(i, _sequence_size - 1, lanes);
 
   for(i = _sequence_size - 1; i >= 1; i--)
   {
@@ -702,7 +5516,7 @@ void FifteenStep::_heapSort()
     _sequence[0] = _sequence[i];
     _sequence[i] = tmp;
 
-    _siftDown(0, i - 1);
+    _siftDown(0, i - 1, lanes);
 
   }
 
@@ -715,26 +5529,31 @@ void FifteenStep::_heapSort()
 // Based on pseudocode found here: http://en.wikipedia.org/wiki/Heapsort
 //
 // @access private
+// @param root of the heap
+// @param last position in the heap
+// @param sort by lane instead of by step
 // @return void
 //
-void FifteenStep::_siftDown(int root, int bottom)
+void FifteenStep::_siftDown(int root, int bottom, bool lanes)
 {
 
   int max = root * 2 + 1;
 
   if(max < bottom)
-    max = _greater(max, max + 1) == max ? max : max + 1;
+    max = _greater(max, max + 1, lanes) == max ? max : max + 1;
   else if(max > bottom)
     return;
 
-  if(_greater(root, max) == root || _greater(root, max) == -1)
+  int greater = _greater(root, max, lanes);
+
+  if(greater == root || greater == -1)
     return;
 
   FifteenStepNote tmp = _sequence[root];
   _sequence[root] = _sequence[max];
   _sequence[max] = tmp;
 
-  _siftDown(max, bottom);
+  _siftDown(max, bottom, lanes);
 
 }
 
@@ -742,40 +5561,398 @@ void FifteenStep::_siftDown(int root, int bottom)
 //
 // Used by heapsort to compare two notes so we
 // know where they should be placed in the sorted
-// array. Will return -1 if they are equal
+// array. Notes are ordered by step, then channel,
+// pitch and velocity, so the notes on a step are
+// next to each other and note offs come before
+// note ons of the same pitch. Empty slots are all
+// zeros, so they end up at the start. Will return
+// -1 if they are equal
 //
 // @access private
 // @param first position to compare
 // @param second position to compare
+// @param compare by lane instead of by step
 // @return int
 //
-int FifteenStep::_greater(int first, int second)
+int FifteenStep::_greater(int first, int second, bool lanes)
 {
 
-  if(_sequence[first].velocity > _sequence[second].velocity)
-    return first;
-  else if(_sequence[second].velocity > _sequence[first].velocity)
-    return second;
-
-  if(_sequence[first].pitch > _sequence[second].pitch)
-    return first;
-  else if(_sequence[second].pitch > _sequence[first].pitch)
-    return second;
+#ifdef FS_BENCHMARK
+  _comparisons++;
+#endif
 
-  if(_sequence[first].step > _sequence[second].step)
-    return first;
-  else if(_sequence[second].step > _sequence[first].step)
-    return second;
+  int result = lanes ? _compareLanes(_sequence[first], _sequence[second]) :
+                       _compare(_sequence[first], _sequence[second]);
 
-  if(_sequence[first].channel > _sequence[second].channel)
+  if(result > 0)
     return first;
-  else if(_sequence[second].channel > _sequence[first].channel)
+  else if(result < 0)
     return second;
 
   return - 1;
 
 }
 
+// _compare
+//
+// Compares two notes by step, channel, pitch and velocity.
+//
+// @access private
+// @param first note
+// @param second note
+// @return int - positive if the first note sorts after the second,
+//         negative if it sorts before, and zero if they match
+//
+int FifteenStep::_compare(const FifteenStepNote &first, const FifteenStepNote &second)
+{
+
+  if(first.step != second.step)
+    return first.step > second.step ? 1 : -1;
+
+  if(first.channel != second.channel)
+    return first.channel > second.channel ? 1 : -1;
+
+  if(first.pitch != second.pitch)
+    return first.pitch > second.pitch ? 1 : -1;
+
+  if(first.velocity != second.velocity)
+    return first.velocity > second.velocity ? 1 : -1;
+
+  return 0;
+
+}
+
+// _compareLanes
+//
+// Compares two notes by lane, then by step, so the
+// notes in each lane end up next to each other in
+// step order. Empty slots still sort to the start.
+//
+// @access private
+// @param first note
+// @param second note
+// @return int - positive if the first note sorts after the second,
+//         negative if it sorts before, and zero if they match
+//
+int FifteenStep::_compareLanes(const FifteenStepNote &first, const FifteenStepNote &second)
+{
+
+  long a = _laneKey(first);
+  long b = _laneKey(second);
+
+  if(a != b)
+    return a > b ? 1 : -1;
+
+  if(first.step != second.step)
+    return first.step > second.step ? 1 : -1;
+
+  return 0;
+
+}
+
+// _triggerTrig
+//
+// Plays a note on that has a trig with timing or a
+// ratchet. Delayed notes are scheduled, and the repeats
+// of a ratchet are handled by one more scheduled event.
+// If the queue is full, the repeats are dropped and the
+// note plays once.
+//
+// @access private
+// @param trig of the note
+// @param velocity of the note
+// @return void
+//
+void FifteenStep::_triggerTrig(FifteenStepTrig* trig, byte velocity)
+{
+
+  unsigned long start = _last_beat + trig->timing * _sixteenth / 256;
+
+  if(trig->timing > 0)
+    _schedule(start, trig->channel, 0x9, trig->pitch, velocity);
+  else
+    _send(trig->channel, 0x9, trig->pitch, velocity);
+
+  if(trig->ratchet < 2 || _queue_count >= FS_QUEUE_SIZE)
+    return;
+
+  unsigned int interval = _stepLength(_position) / trig->ratchet;
+
+  velocity -= (unsigned int) velocity * trig->decay / 100;
+
+  _schedule(start + interval, trig->channel, 0x9, trig->pitch, velocity > 0 ? velocity : 1);
+
+  FifteenStepEvent &repeat = _queue[_queue_count - 1];
+
+  repeat.repeats = trig->ratchet - 1;
+  repeat.decay = trig->decay;
+  repeat.interval = interval;
+
+}
+
+// _arpStep
+//
+// Plays the next arpeggiator note. The note is picked from
+// the held notes with a little math, so the work done on
+// each step doesn't depend on how many notes are held or
+// how many are in the sequence.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_arpStep()
+{
+
+  if(++_arp_tick < _arp_division)
+    return;
+
+  _arp_tick = 0;
+
+  _arpRelease();
+
+  if(_arp_count == 0 || ! _hasOutput() || _isSilent(_arp_channel))
+    return;
+
+  byte pitch = _arpPitch();
+
+  _send(_arp_channel, 0x9, pitch, _arp_velocity);
+
+  // schedule the note off, or hold it until the next note
+  if(_arp_gate < 100 && _queue_count < FS_QUEUE_SIZE)
+    _schedule(_last_beat + _sixteenth * _arp_division * _arp_gate / 100, _arp_channel, 0x8, pitch, 0);
+  else
+    _arp_last = pitch;
+
+  if(_arp_record)
+    _arpRecord(pitch, _arp_velocity);
+
+}
+
+// _arpPitch
+//
+// Returns the next arpeggiator note and moves the
+// arpeggiator forward. Notes in higher octaves are
+// counted after the held notes, so every mode can
+// walk the whole range with one index.
+//
+// @access private
+// @return byte - pitch
+//
+byte FifteenStep::_arpPitch()
+{
+
+  int total = _arp_count * _arp_octaves;
+  int period = total;
+  int index;
+
+  if(_arp_mode == FS_ARP_UP_DOWN && total > 1)
+    period = total * 2 - 2;
+
+  // nothing is held
+  if(period == 0)
+    return 0;
+
+  index = _arp_index % period;
+  _arp_index = (index + 1) % period;
+
+  if(_arp_mode == FS_ARP_DOWN)
+    index = total - 1 - index;
+  else if(_arp_mode == FS_ARP_UP_DOWN && index >= total)
+    index = period - index;
+  else if(_arp_mode == FS_ARP_RANDOM)
+    index = ((unsigned int) (_random() & 0xFF) * total) >> 8;
+
+  byte note = index % _arp_count;
+  byte pitch = _arp_mode == FS_ARP_PLAYED ? _arp_order[note] : _arp_notes[note];
+  unsigned int octave = pitch + 12 * (index / _arp_count);
+
+  return octave > 127 ? pitch : octave;
+
+}
+
+// _arpRelease
+//
+// Turns off the last arpeggiator note if
+// it is still being held.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_arpRelease()
+{
+
+  if(_arp_last == 0xFF)
+    return;
+
+  _send(_arp_channel, 0x8, _arp_last, 0);
+  _arp_last = 0xFF;
+
+}
+
+// _arpRecord
+//
+// Records an arpeggiator note into the current pattern.
+// The note off goes on the step of the next note. Both
+// are stored as one edit, so they are merged into the
+// sequence in one pass.
+//
+// @access private
+// @param pitch of note
+// @param velocity of note
+// @return void
+//
+void FifteenStep::_arpRecord(byte pitch, byte velocity)
+{
+
+  int on = _offset() + _position;
+  int off = _offset() + (_position + _arp_division) % _steps;
+
+  beginEdit();
+
+  if(_findNote(_arp_channel, pitch, true, on) < 0)
+    _storeNote(_arp_channel, pitch, velocity, on);
+
+  if(_findNote(_arp_channel, pitch, false, off) < 0)
+    _storeNote(_arp_channel, pitch, 0, off);
+
+  commitEdit();
+
+}
+
+// _nextPass
+//
+// Starts a new overdub pass in the undo log. If the
+// last pass didn't add anything, it is used again.
+// The oldest pass is forgotten once FS_UNDO_PASSES
+// are in the log.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_nextPass()
+{
+
+  if(_pass_count > 0 && _undo_passes[_pass_count - 1] == 0)
+    return;
+
+  if(_pass_count == FS_UNDO_PASSES) {
+
+    byte oldest = _undo_passes[0];
+
+    _undo_start = (_undo_start + oldest) % FS_UNDO_SIZE;
+    _undo_count -= oldest;
+
+    for(byte i = 1; i < _pass_count; ++i)
+      _undo_passes[i - 1] = _undo_passes[i];
+
+    _pass_count--;
+
+  }
+
+  _undo_passes[_pass_count++] = 0;
+
+}
+
+// _logUndo
+//
+// Adds a note to the current overdub pass. The undo
+// log is a ring, so when it is full the oldest note
+// is forgotten. The log is only allocated once the
+// first overdub note is added.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param velocity of note
+// @param position in sequence
+// @return void
+//
+void FifteenStep::_logUndo(byte channel, byte pitch, byte velocity, int position)
+{
+
+  if(! _undo)
+    _undo = new FifteenStepNote[FS_UNDO_SIZE];
+
+  if(_pass_count == 0)
+    _undo_passes[_pass_count++] = 0;
+
+  // out of room, so forget the oldest note
+  if(_undo_count == FS_UNDO_SIZE) {
+
+    _undo_start = (_undo_start + 1) % FS_UNDO_SIZE;
+    _undo_count--;
+    _undo_passes[0]--;
+
+    // drop the oldest pass if it is now empty
+    if(_undo_passes[0] == 0 && _pass_count > 1) {
+
+      for(byte i = 1; i < _pass_count; ++i)
+        _undo_passes[i - 1] = _undo_passes[i];
+
+      _pass_count--;
+
+    }
+
+  }
+
+  FifteenStepNote &note = _undo[(_undo_start + _undo_count) % FS_UNDO_SIZE];
+
+  note.channel = channel;
+  note.pitch = pitch;
+  note.velocity = velocity;
+  note.step = position;
+
+  _undo_count++;
+  _undo_passes[_pass_count - 1]++;
+
+}
+
+// _clearUndo
+//
+// Empties the undo log. Called when notes are
+// changed in ways that overdub passes can't be
+// undone from.
+//
+// @access private
+// @return void
+//
+void FifteenStep::_clearUndo()
+{
+
+  _undo_start = 0;
+  _undo_count = 0;
+  _pass_count = 0;
+
+  if(_overdub)
+    _nextPass();
+
+}
+
+// _findNote
+//
+// Returns the slot of a note on or off on a step,
+// or -1 if it isn't there.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param true for a note on
+// @param position in sequence
+// @return int
+//
+int FifteenStep::_findNote(byte channel, byte pitch, bool on, int position)
+{
+
+  for(int i = _firstAt(position); i < _sequence_size && _sequence[i].step == position; ++i)
+  {
+    if(_sequence[i].channel == channel && _sequence[i].pitch == pitch && (_sequence[i].velocity > 0) == on)
+      return i;
+  }
+
+  return -1;
+
+}
+
 // _triggerNotes
 //
 // Calls the user defined MIDI callback with
@@ -789,29 +5966,67 @@ void FifteenStep::_triggerNotes()
 {
 
   // bail if the midi callback isn't set
-  if(! _midi_cb)
+  if(! _hasOutput())
     return;
 
-  // loop through the sequence again and trigger note ons at the current position
-  for(int i=0; i < _sequence_size; ++i)
-  {
+  // position of the current step in the sequence
+  int step = _offset() + _position;
 
-    // ignore if it's not the current position
-    if(_sequence[i].step != _position)
-      continue;
+  // note messages sent by this step
+  unsigned int sent = 0;
+
+  // controller values go out before the notes they shape
+  if(_lock_count > 0)
+    _sendLocks(step);
+
+  // notes are sorted by step, so jump to the first
+  // note at the current position and stop after the last
+  for(int i = _firstAt(step); i < _sequence_size && _sequence[i].step == step; ++i)
+  {
 
     // if this position is in the default state, ignore it
     if(_sequence[i].pitch == 0 && _sequence[i].velocity == 0 && _sequence[i].step == 0)
       continue;
 
+    // muted note ons are skipped, but note offs always go out
+    if(_silent && _sequence[i].velocity > 0 && _isSilent(_sequence[i].channel))
+      continue;
+
+    // trigs can skip, delay or repeat the note on
+    if(_trig_count > 0 && _sequence[i].velocity > 0) {
+
+      FifteenStepTrig* trig = _findTrig(_sequence[i].channel, _sequence[i].pitch, step);
+
+      if(trig && ! _trigPlays(trig))
+        continue;
+
+      if(trig && (trig->timing > 0 || trig->ratchet > 1)) {
+        _triggerTrig(trig, _sequence[i].velocity);
+        sent++;
+        continue;
+      }
+
+    }
+
+    // stop any repeats that are still waiting
+    if(_queue_count > 0 && _sequence[i].velocity == 0)
+      _cancelRepeats(_sequence[i].channel, _sequence[i].pitch);
+
     // send note on values to callback
-    _midi_cb(
+    _send(
       _sequence[i].channel,
       _sequence[i].velocity > 0 ? 0x9 : 0x8,
       _sequence[i].pitch,
       _sequence[i].velocity
     );
 
+    sent++;
+
   }
 
+  _stats.notes += sent;
+
+  if(sent > _stats.max_notes)
+    _stats.max_notes = sent;
+
 }
@@ -9,7 +9,15 @@
 #ifndef _FifteenStep_h
 #define _FifteenStep_h
 
+#ifdef ARDUINO
 #include "Arduino.h"
+#else
+// host builds (see CMakeLists.txt) don't have the Arduino
+// core, so a clock must be set with setClockSource
+#include <stdint.h>
+#include <stddef.h>
+typedef uint8_t byte;
+#endif
 
 #define FS_DEFAULT_TEMPO 120
 #define FS_DEFAULT_STEPS 16
@@ -17,6 +25,50 @@
 #define FS_MIN_TEMPO 10
 #define FS_MAX_TEMPO 250
 #define FS_MAX_STEPS 256
+#define FS_CHUNK_SIZE 16
+#define FS_FORMAT_VERSION 1
+#define FS_MIDI_PPQ 96
+#define FS_SYSEX_ID 0x7D
+#define FS_SYSEX_CHUNK 6
+#define FS_MAX_TRIGS 16
+#define FS_MAX_LOCKS 32
+#define FS_UNDO_SIZE 32
+#define FS_UNDO_PASSES 4
+#define FS_QUEUE_SIZE 8
+#define FS_MAX_TRANSFORMS 4
+#define FS_MAX_RATCHET 8
+#define FS_ANY_CHANNEL 0xFF
+#define FS_HELD_NOTES 8
+#define FS_ARP_NOTES 8
+#define FS_ARP_OCTAVES 8
+
+// arpeggiator modes
+#define FS_ARP_OFF 0
+#define FS_ARP_UP 1
+#define FS_ARP_DOWN 2
+#define FS_ARP_UP_DOWN 3
+#define FS_ARP_RANDOM 4
+#define FS_ARP_PLAYED 5
+
+// trig conditions
+#define FS_TRIG_ALWAYS 0
+#define FS_TRIG_FIRST 1
+#define FS_TRIG_NOT_FIRST 2
+#define FS_TRIG_EVERY(a, b) (((b) << 4) | (((a) - 1) & 0xF))
+
+// pattern transforms
+#define FS_TRANSFORM_NONE 0
+#define FS_TRANSFORM_TRANSPOSE 1
+#define FS_TRANSFORM_ROTATE 2
+#define FS_TRANSFORM_REVERSE 3
+#define FS_TRANSFORM_VELOCITY 4
+
+// setNote results
+#define FS_NOTE_IGNORED 0
+#define FS_NOTE_STORED 1
+#define FS_NOTE_REMOVED 2
+#define FS_NOTE_DROPPED 3
+#define FS_NOTE_PENDING 4
 
 // MIDIcallback
 //
@@ -30,10 +82,11 @@
 // arg1: pitch value
 // arg1: velocity value
 //
-// It's possible that there will be other types of MIDI messages sent
-// to this callback in the future, so please check the command sent if
-// you are doing something other than passing on the MIDI messages to
-// a MIDI library.
+// Parameter locks are sent as control changes (0xB), with the
+// controller number in arg1 and the value in arg2. It's possible that
+// there will be other types of MIDI messages sent to this callback in
+// the future, so please check the command sent if you are doing
+// something other than passing on the MIDI messages to a MIDI library.
 //
 typedef void (*MIDIcallback) (byte channel, byte command, byte arg1, byte arg2);
 
@@ -47,6 +100,73 @@ typedef void (*MIDIcallback) (byte channel, byte command, byte arg1, byte arg2);
 //
 typedef void (*StepCallback) (int current, int last);
 
+// NoteCallback
+//
+// This defines the format of the callback used by forEachNote().
+// It is called with each matching note, and the step is relative
+// to the start of the current pattern. The context argument is
+// passed through from forEachNote().
+//
+typedef void (*NoteCallback) (void* context, byte channel, byte pitch, byte velocity, byte step);
+
+// MIDIContextCallback
+//
+// The same as MIDIcallback, but with a user data pointer passed
+// through from setMidiHandler() as the first argument. This lets
+// one handler serve several sequencers or MIDI outputs without
+// using globals.
+//
+typedef void (*MIDIContextCallback) (void* context, byte channel, byte command, byte arg1, byte arg2);
+
+// StepContextCallback
+//
+// The same as StepCallback, but with a user data pointer passed
+// through from setStepHandler() as the first argument.
+//
+typedef void (*StepContextCallback) (void* context, int current, int last);
+
+// ClockCallback
+//
+// This defines the format of the callback used as the clock
+// source of the sequencer. The callback should return the
+// current time in milliseconds. By default the sequencer uses
+// millis(), but a virtual clock can be used to run the
+// sequencer faster than real time. The context argument is
+// passed through from setClockSource().
+//
+typedef unsigned long (*ClockCallback) (void* context);
+
+// WriteCallback
+//
+// This defines the format of the callback used when saving the
+// sequence with serialize(). The callback will be called with
+// chunks of up to FS_CHUNK_SIZE bytes, so it can write them to
+// EEPROM, flash, or a Stream without the whole pattern being
+// held in memory. The context argument is passed through from
+// serialize() and can be used to track things like the
+// current EEPROM address.
+//
+typedef void (*WriteCallback) (void* context, const byte* data, byte length);
+
+// ReadCallback
+//
+// This defines the format of the callback used when loading the
+// sequence with deserialize(). The callback should copy up to
+// length bytes into data, and return the number of bytes that
+// were copied. Returning zero tells the sequencer that there
+// is no more data.
+//
+typedef byte (*ReadCallback) (void* context, byte* data, byte length);
+
+// SysExCallback
+//
+// This defines the format of the callback used to send SysEx
+// pattern dumps. The callback will be called once for each
+// complete SysEx message, including the 0xF0 and 0xF7 bytes.
+// Messages are small enough to fit in a single BLE MIDI packet.
+//
+typedef void (*SysExCallback) (void* context, const byte* data, byte length);
+
 // FifteenStepNote
 //
 // This defines the note type that is used when storing sequence note
@@ -60,14 +180,140 @@ typedef struct
   byte step;
 } FifteenStepNote;
 
+// FifteenStepTrig
+//
+// This defines the optional playback settings for a single
+// note on. Trigs are kept in a small separate table that is only
+// allocated once the first one is set, so notes that don't use
+// them still only take up four bytes. The timing value delays
+// the note on by timing / 256 of a sixteenth note. Probability
+// is the percent chance the note plays, and condition is one of
+// the FS_TRIG_* values, which decide which loops it plays on.
+// A ratchet repeats the note evenly inside its step, and each
+// repeat is quieter by the decay percent.
+typedef struct
+{
+  byte channel;
+  byte pitch;
+  byte step;
+  byte timing;
+  byte probability;
+  byte condition;
+  byte ratchet;
+  byte decay;
+} FifteenStepTrig;
+
+// FifteenStepLock
+//
+// This defines a parameter lock, which sends a MIDI control
+// change on a step. Locks are kept in their own small table in
+// step order, so automation doesn't use up note slots, and the
+// table is only allocated once the first lock is set.
+typedef struct
+{
+  byte channel;
+  byte controller;
+  byte step;
+  byte value;
+} FifteenStepLock;
+
+// FifteenStepEvent
+//
+// This defines a MIDI event that has been scheduled to be
+// sent at a time in between steps. Ratchets use a single
+// event that retriggers its note every interval milliseconds
+// until there are no repeats left.
+typedef struct
+{
+  unsigned long time;
+  byte channel;
+  byte command;
+  byte arg1;
+  byte arg2;
+  byte repeats;
+  byte decay;
+  unsigned int interval;
+} FifteenStepEvent;
+
+// RenderCallback
+//
+// This defines the format of the callback that receives the
+// output of render(). Each event includes the number of steps
+// since the render started, and the time in milliseconds since
+// the render started. Steps are sixteenth notes, so the bar is
+// step / 16 and the sixteenth in the bar is step % 16.
+//
+typedef void (*RenderCallback) (void* context, unsigned long step, const FifteenStepEvent &event);
+
+// FifteenStepTransform
+//
+// This defines a pattern transform that is waiting for the
+// end of the loop. The amount is semitones for a transpose,
+// steps for a rotate and a percent for a velocity scale.
+typedef struct
+{
+  byte type;
+  byte channel;
+  int amount;
+} FifteenStepTransform;
+
+// FifteenStepStats
+//
+// This defines the runtime counters that the sequencer keeps
+// while it is running. They are updated in place with a few
+// compares and additions, and can be read with getStats() to
+// find out why playback sounded sloppy. Times are in
+// milliseconds unless noted.
+typedef struct
+{
+  unsigned long elapsed;      // time since the stats were reset
+  unsigned long runs;         // number of calls to run()
+  unsigned long max_gap;      // longest time between calls to run()
+  unsigned long steps;        // number of steps played
+  unsigned long late_steps;   // steps played after they were due
+  unsigned long total_late;   // total time that steps were late
+  unsigned long max_late;     // latest that a step was played
+  unsigned long notes;        // note messages sent by steps
+  unsigned int  max_notes;    // most note messages sent by one step
+  unsigned long max_set_note; // longest setNote() call in microseconds
+  int           max_used;     // most sequence slots used at once
+  unsigned long dropped;      // notes that didn't fit in the sequence
+} FifteenStepStats;
+
+// used internally to stream serialized data in chunks
+struct FifteenStepBuffer;
+
+// see FifteenStepJournal.h
+class FifteenStepJournal;
+class FifteenStepSimulator;
+class FifteenStepBenchmark;
+
 // default values for sequence array members
 const FifteenStepNote DEFAULT_NOTE = {0x0, 0x0, 0x0, 0x0};
 
+// FifteenStepSongEntry
+//
+// This defines one entry of a song arrangement. Each entry
+// plays the stored pattern with the matching id for the given
+// number of loops before moving on to the next entry. Patterns
+// are stored once in the sequence as consecutive pages of
+// steps, so pattern 0 uses steps 0 to (steps - 1), pattern 1
+// uses steps (steps) to (steps * 2 - 1), and so on.
+typedef struct
+{
+  byte pattern;
+  byte repeats;
+} FifteenStepSongEntry;
+
 class FifteenStep
 {
+  friend class FifteenStepJournal;
+  friend class FifteenStepSimulator;
+  friend class FifteenStepBenchmark;
   public:
     FifteenStep();
     FifteenStep(int memory);
+    ~FifteenStep();
     void  begin();
     void  begin(int tempo);
     void  begin(int tempo, int steps);
@@ -84,35 +330,233 @@ class FifteenStep
     void  increaseShuffle();
     void  decreaseShuffle();
     void  setMidiHandler(MIDIcallback cb);
+    void  setMidiHandler(MIDIContextCallback cb, void* context);
     void  setStepHandler(StepCallback cb);
-    void  setNote(byte channel, byte pitch, byte velocity, byte step = -1);
+    void  setStepHandler(StepContextCallback cb, void* context);
+    void  setClockSource(ClockCallback cb, void* context = NULL);
+    byte  setNote(byte channel, byte pitch, byte velocity, byte step = -1);
+    byte  recordNote(byte channel, byte pitch, byte velocity, unsigned long timestamp);
+    void  setOverdub(bool overdub);
+    int   undoLastPass();
+    void  beginEdit();
+    void  commitEdit();
+    bool  transpose(int semitones, byte channel = FS_ANY_CHANNEL, bool atLoop = false);
+    bool  rotate(int steps, bool atLoop = false);
+    bool  reverse(bool atLoop = false);
+    bool  scaleVelocity(int percent, byte channel = FS_ANY_CHANNEL, bool atLoop = false);
+    int   euclid(byte hits, byte steps, byte rotation, byte channel, byte pitch, byte velocity, byte length = 1);
+    int   randomFill(byte density, byte channel, byte pitch, byte velocity, byte length = 1);
+    void  setSeed(uint32_t seed);
+    void  setInputLatency(unsigned long latency);
+    void  setMicrotiming(bool keep);
+    bool  setProbability(byte channel, byte pitch, byte percent, byte step);
+    bool  setCondition(byte channel, byte pitch, byte condition, byte step);
+    bool  setRatchet(byte channel, byte pitch, byte repeats, byte step, byte decay = 0);
+    bool  setLock(byte channel, byte controller, byte value, byte step);
+    void  clearLock(byte channel, byte controller, byte step);
+    void  clearLocks(byte channel, byte controller);
+    void  setMute(byte channel, bool mute);
+    void  setSolo(byte channel, bool solo);
+    void  setMuteMask(uint16_t mask);
+    void  setSoloMask(uint16_t mask);
+    uint16_t getMuteMask();
+    uint16_t getSoloMask();
+    void  setArpeggiator(byte mode, byte octaves = 1, byte division = 1, byte channel = 0);
+    void  setArpGate(byte percent);
+    void  setArpRecord(bool record);
+    void  arpNoteOn(byte pitch, byte velocity);
+    void  arpNoteOff(byte pitch);
+    void  setPattern(byte pattern);
+    void  setSong(const FifteenStepSongEntry* song, byte length, bool repeat = true);
+    int   serialize(WriteCallback cb, void* context = NULL);
+    bool  deserialize(ReadCallback cb, void* context = NULL);
+    long  exportMidi(WriteCallback cb, void* context = NULL, byte format = 0);
+    bool  importMidi(ReadCallback cb, void* context = NULL);
+    void  setSysExHandler(SysExCallback cb, void* context = NULL);
+    int   sendDump();
+    bool  receiveSysEx(const byte* data, int length);
+    unsigned long render(unsigned int bars, RenderCallback cb, void* context = NULL);
     byte  getPosition();
+    byte  getSteps();
+    byte  getPattern();
+    byte  getSongPosition();
     FifteenStepNote* getSequence();
+    int   getCapacity();
+    int   getUsedSlots();
+    int   getFreeSlots();
+    int   getStepSlots(byte step);
+    int   forEachNote(byte first, byte last, byte channel, NoteCallback cb, void* context = NULL);
+    bool  nextChange(int &position);
+    void  clearChanges();
+    FifteenStepStats getStats();
+    void  resetStats();
   private:
+    // the sequence memory is owned, so copies aren't allowed
+    FifteenStep(const FifteenStep &);
+    FifteenStep&      operator=(const FifteenStep &);
     MIDIcallback      _midi_cb;
     StepCallback      _step_cb;
+    MIDIContextCallback _midi_context_cb;
+    StepContextCallback _step_context_cb;
+    void*             _midi_context;
+    void*             _step_context;
+    ClockCallback     _clock_cb;
+    void*             _clock_context;
+    FifteenStepJournal* _journal;
+    SysExCallback     _sysex_cb;
+    void*             _sysex_context;
+    RenderCallback    _render_cb;
+    void*             _render_context;
     FifteenStepNote*  _sequence;
+    FifteenStepTrig*  _trigs;
+    FifteenStepLock*  _locks;
+    FifteenStepNote*  _undo;
+    byte              _undo_passes[FS_UNDO_PASSES];
+    FifteenStepEvent  _queue[FS_QUEUE_SIZE];
+    FifteenStepTransform _transforms[FS_MAX_TRANSFORMS];
+    byte              _arp_notes[FS_ARP_NOTES];
+    byte              _arp_order[FS_ARP_NOTES];
+    FifteenStepStats  _stats;
+    // one bit per step, so an edit to any channel or pitch
+    // marks the whole step as changed
+    byte              _dirty[FS_MAX_STEPS / 8];
+    byte*             _sysex_buffer;
+    const FifteenStepSongEntry* _song;
     bool              _running;
+    bool              _song_repeat;
+    bool              _sysex_pending;
+    bool              _microtiming;
+    bool              _on_time;
+    bool              _arp_record;
+    bool              _overdub;
+    byte              _undo_start;
+    byte              _undo_count;
+    byte              _pass_count;
+    byte              _arp_mode;
+    byte              _arp_octaves;
+    byte              _arp_division;
+    byte              _arp_channel;
+    byte              _arp_gate;
+    byte              _arp_count;
+    byte              _arp_index;
+    byte              _arp_tick;
+    byte              _arp_velocity;
+    byte              _arp_last;
+    byte              _edit_depth;
+    byte              _transform_count;
+    int               _edit_base;
+    int               _edit_count;
     int               _sequence_size;
+    unsigned int      _sysex_length;
+    unsigned int      _sysex_received;
     int               _tempo;
     byte              _steps;
     byte              _position;
+    byte              _pattern;
+    byte              _patterns;
+    byte              _song_length;
+    byte              _song_index;
+    byte              _song_loops;
+    byte              _trig_count;
+    byte              _lock_count;
+    byte              _queue_count;
     unsigned long     _clock;
     unsigned long     _sixteenth;
     unsigned long     _shuffle;
     unsigned long     _next_beat;
+    unsigned long     _last_beat;
+    unsigned long     _latency;
     unsigned long     _next_clock;
+    unsigned long     _last_run;
+    unsigned long     _stats_start;
+    unsigned long     _render_time;
+    unsigned long     _render_step;
+    unsigned long     _render_count;
+    uint32_t          _seed;
+    uint16_t          _mute;
+    uint16_t          _solo;
+    uint16_t          _silent;
+    unsigned int      _loops;
+#ifdef FS_BENCHMARK
+    unsigned long     _comparisons;
+#endif
+    unsigned long     _now();
+    unsigned long     _micros();
     unsigned long     _shuffleDivision();
     int               _quantizedPosition();
-    int               _greater(int first, int second);
+    int               _quantize(unsigned long time, bool floor, unsigned long &delay);
+    unsigned long     _stepLength(int position);
+    int               _greater(int first, int second, bool lanes = false);
+    static int        _compare(const FifteenStepNote &first, const FifteenStepNote &second);
+    static int        _compareEdits(const FifteenStepNote &first, const FifteenStepNote &second);
+    static int        _compareLanes(const FifteenStepNote &first, const FifteenStepNote &second);
+    uint32_t          _random();
+    int               _offset();
     void              _init(int memory);
-    void              _heapSort();
-    void              _siftDown(int root, int bottom);
+    void              _heapSort(bool lanes = false);
+    void              _siftDown(int root, int bottom, bool lanes = false);
     void              _resetSequence();
     void              _loopPosition();
+    void              _nextPattern();
+    void              _loadSysEx();
+    byte              _storeNote(byte channel, byte pitch, byte velocity, int position);
+    byte              _toggleNote(byte channel, byte pitch, byte velocity, int position, int skip = 0, int count = 0);
+    void              _applyEdits();
+    bool              _queueTransform(byte type, int amount, byte channel, bool atLoop);
+    void              _runTransform(FifteenStepTransform* transforms, byte count, int last);
+    void              _releaseNotes(byte channel, int last);
+    void              _transposeNotes(int semitones, byte channel);
+    void              _rotateNotes(int steps);
+    void              _reverseNotes();
+    void              _scaleNotes(int percent, byte channel);
+    void              _reverseSlots(int first, int last);
+    void              _packSlots(int end);
+    void              _nextPass();
+    void              _logUndo(byte channel, byte pitch, byte velocity, int position);
+    void              _clearUndo();
+    int               _findNote(byte channel, byte pitch, bool on, int position);
+    int               _generate(byte* hits, byte channel, byte pitch, byte velocity, byte length);
+    bool              _hasNoteOn(byte channel, byte pitch, int position);
+    FifteenStepTrig*  _findTrig(byte channel, byte pitch, byte step);
+    FifteenStepTrig*  _addTrig(byte channel, byte pitch, byte step);
+    void              _removeTrig(byte channel, byte pitch, byte step);
+    void              _trimTrig(FifteenStepTrig* trig);
+    int               _firstLock(int position);
+    void              _removeLock(byte index);
+    void              _sortLocks();
+    void              _sendLocks(int position);
+    void              _updateSilent();
+    bool              _isSilent(byte channel);
+    bool              _trigPlays(FifteenStepTrig* trig);
+    void              _schedule(unsigned long time, byte channel, byte command, byte arg1, byte arg2);
+    void              _runQueue(unsigned long now);
+    void              _cancelRepeats(byte channel, byte pitch);
+    void              _markDirty(int position);
+    void              _markAllDirty();
+    bool              _isEmpty(int i);
+    int               _usedSlots();
+    int               _firstAt(int position);
+    static long       _laneKey(const FifteenStepNote &note);
+    int               _laneEnd(int start);
+    byte              _laneRuns(int start, int end, FifteenStepBuffer* out);
+    bool              _readSequence(ReadCallback cb, void* context, byte* header, bool stage);
+    bool              _stageNote(int &slot, FifteenStepNote note);
+    void              _endStage(bool keep, int first, int last);
+    void              _midiTrack(FifteenStepBuffer &out, unsigned int channels, bool tempo);
+    unsigned long     _stepTicks(int step, unsigned long sixteenth, unsigned long shuffle);
+    int               _tickToStep(unsigned long tick, unsigned long sixteenth, unsigned long shuffle, bool up);
+    bool              _removeDuplicates();
+    bool              _hasOutput();
+    void              _send(byte channel, byte command, byte arg1, byte arg2);
+    static unsigned long _renderClock(void* context);
     void              _tick();
     void              _step();
+    void              _triggerTrig(FifteenStepTrig* trig, byte velocity);
     void              _triggerNotes();
+    void              _arpStep();
+    byte              _arpPitch();
+    void              _arpRelease();
+    void              _arpRecord(byte pitch, byte velocity);
 };
 
 #endif
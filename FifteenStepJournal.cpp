@@ -0,0 +1,600 @@
+// ---------------------------------------------------------------------------
+//
+// FifteenStepJournal.cpp
+// Wear leveled pattern storage for the FifteenStep sequencer.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStepJournal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            CONSTRUCTORS                                   //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// FifteenStepJournal
+//
+// Sets up a journal that saves a sequence to a ring of
+// storage pages. Every note edit is appended to the current
+// page, and the whole sequence is written as a snapshot when
+// the journal fills up half of the ring. Since new data always
+// goes to the next page in the ring, writes are spread evenly
+// across all of the pages. The ring should be at least twice
+// the size of a serialized snapshot.
+//
+// @access public
+// @param number of pages in the ring
+// @param size of each page in bytes
+// @param callback used to read from storage
+// @param callback used to write to storage
+// @param optional callback used to erase flash pages
+// @param user data passed to the callbacks
+//
+FifteenStepJournal::FifteenStepJournal(unsigned int pages, unsigned int size, StorageReadCallback read, StorageWriteCallback write, StorageEraseCallback erase, void* context)
+{
+
+  _seq = NULL;
+  _read_cb = read;
+  _write_cb = write;
+  _erase_cb = erase;
+  _context = context;
+  _restoring = false;
+  _full = false;
+  _pages = pages;
+  _size = size;
+  _start = pages - 1;
+  _page = pages - 1;
+  _offset = size;
+  _serial = 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            PUBLIC METHODS                                 //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// begin
+//
+// Attaches the journal to a sequencer and restores the last
+// saved sequence. The newest snapshot in the ring is loaded,
+// and the edits that were saved after it are replayed in
+// order without sorting, so start up time is linear in the
+// size of the journal. If the storage is empty, the current
+// sequence is saved as the first snapshot.
+//
+// @access public
+// @param the sequencer to save and restore
+// @return bool - true if a saved sequence was restored
+//
+bool FifteenStepJournal::begin(FifteenStep &seq)
+{
+
+  _seq = &seq;
+  _seq->_journal = this;
+
+  bool found = false;
+  unsigned int best = 0;
+  unsigned int newest = 0;
+
+  // find the newest snapshot
+  for(unsigned int p = 0; p < _pages; ++p)
+  {
+
+    byte type;
+    unsigned int serial;
+
+    if(! _header(p, type, serial) || type != FS_PAGE_SNAPSHOT)
+      continue;
+
+    unsigned int age = (serial - newest) & 0xFFFF;
+
+    if(! found || (age > 0 && age < 0x8000)) {
+      found = true;
+      best = p;
+      newest = serial;
+    }
+
+  }
+
+  // nothing saved yet, so start the ring at the first page
+  if(! found) {
+    _start = _pages - 1;
+    _page = _pages - 1;
+    _serial = 0;
+    compact();
+    return false;
+  }
+
+  _restoring = true;
+
+  // the snapshot reader uses the page cursor
+  _start = best;
+  _page = best;
+  _offset = FS_JOURNAL_HEADER;
+  _serial = newest;
+
+  byte header[9];
+
+  // check the snapshot before the current notes are
+  // cleared to make room for it, then read it again
+  if(_seq->_readSequence(_snapshotRead, this, header, false)) {
+
+    _page = best;
+    _offset = FS_JOURNAL_HEADER;
+    _serial = newest;
+
+    _seq->_resetSequence();
+    _seq->deserialize(_snapshotRead, this);
+
+  }
+
+  bool edits = false;
+
+  // replay the edits that follow the snapshot
+  while(true)
+  {
+
+    unsigned int next = (_page + 1) % _pages;
+    byte type;
+    unsigned int serial;
+
+    if(next == _start)
+      break;
+
+    if(! _header(next, type, serial) || type != FS_PAGE_EDITS)
+      break;
+
+    if(serial != ((_serial + 1) & 0xFFFF))
+      break;
+
+    _page = next;
+    _serial = serial;
+    _offset = FS_JOURNAL_HEADER;
+    edits = true;
+
+    while(_offset + FS_JOURNAL_ENTRY <= _size)
+    {
+
+      byte entry[FS_JOURNAL_ENTRY];
+
+      _read_cb(_context, _address(_page, _offset), entry, FS_JOURNAL_ENTRY);
+
+      // unused space
+      if(entry[0] == 0xFF)
+        break;
+
+      _seq->_toggleNote(entry[0], entry[1], entry[2], entry[3]);
+      _offset += FS_JOURNAL_ENTRY;
+
+    }
+
+  }
+
+  // one ordering pass for all of the edits
+  _seq->_heapSort();
+
+  _restoring = false;
+
+  // power was lost before the first edit page was started
+  if(! edits)
+    _startPage(FS_PAGE_EDITS);
+
+  return true;
+
+}
+
+// record
+//
+// Appends a note edit to the journal. This is called by the
+// sequencer every time setNote changes the sequence, using
+// the position of the note in the whole sequence. If the
+// journal has filled half of the ring, a new snapshot is
+// written instead, which already contains this edit. If the
+// ring is too small to hold a snapshot, the edit is dropped
+// and full() will return true.
+//
+// @access public
+// @param channel of note
+// @param pitch of note
+// @param velocity of note
+// @param position in sequence
+// @return void
+//
+void FifteenStepJournal::record(byte channel, byte pitch, byte velocity, byte step)
+{
+
+  if(! _seq || _restoring)
+    return;
+
+  // current page is full
+  if(_offset + FS_JOURNAL_ENTRY > _size) {
+
+    if(_live() >= _pages / 2 && _snapshot(false))
+      return;
+
+    // out of free pages, so write over the current snapshot
+    if(_live() >= _pages && _snapshot(true))
+      return;
+
+    // no room left, so the edit can't be saved
+    if(_live() >= _pages) {
+      _full = true;
+      return;
+    }
+
+    _startPage(FS_PAGE_EDITS);
+
+  }
+
+  byte entry[FS_JOURNAL_ENTRY] = {channel, pitch, velocity, step};
+
+  _write_cb(_context, _address(_page, _offset), entry, FS_JOURNAL_ENTRY);
+  _offset += FS_JOURNAL_ENTRY;
+
+}
+
+// compact
+//
+// Writes the whole sequence and its settings as a new
+// snapshot in the free pages after the journal, and starts
+// a new edit page after it. The snapshot header is written
+// last, so the old snapshot is still used if power is lost
+// before the new one is complete. This is called for you
+// when the journal fills up or the sequence is replaced,
+// but it can also be called after changing the tempo, step
+// count, or shuffle so the new settings are saved.
+//
+// If the free pages can't hold the snapshot, it is written
+// over the current one instead, so the journal never stops
+// saving edits. record() only does this once every page is
+// in use. The saved sequence is lost if power goes out
+// while that snapshot is being written.
+//
+// @access public
+// @return bool - false if the snapshot doesn't fit in the ring
+//
+bool FifteenStepJournal::compact()
+{
+
+  if(! _seq || _restoring)
+    return false;
+
+  if(_snapshot(true))
+    return true;
+
+  // the change that called for the snapshot isn't saved
+  _full = true;
+
+  return false;
+
+}
+
+// full
+//
+// Returns true if a change to the sequence couldn't be
+// saved because the ring is too small to hold a snapshot.
+// This is cleared the next time a snapshot is saved.
+//
+// @access public
+// @return bool
+//
+bool FifteenStepJournal::full()
+{
+  return _full;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            PRIVATE METHODS                                //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// _live
+//
+// Returns the number of pages used by the current
+// snapshot and the edits that follow it.
+//
+// @access private
+// @return unsigned int
+//
+unsigned int FifteenStepJournal::_live()
+{
+  return (_page + _pages - _start) % _pages + 1;
+}
+
+// _fits
+//
+// Checks if a number of edits can be added with record()
+// before the journal has to write a snapshot. Edit pages
+// can be started until half of the ring is in use.
+//
+// @access private
+// @param number of edits
+// @return bool
+//
+bool FifteenStepJournal::_fits(unsigned int count)
+{
+
+  if(! _seq || _restoring)
+    return true;
+
+  unsigned long room = (_size - _offset) / FS_JOURNAL_ENTRY;
+  unsigned int live = _live();
+
+  if(live < _pages / 2)
+    room += (unsigned long) (_pages / 2 - live) * ((_size - FS_JOURNAL_HEADER) / FS_JOURNAL_ENTRY);
+
+  return room >= count;
+
+}
+
+// _snapshot
+//
+// Writes the snapshot for compact(). Free pages after the
+// journal are used if there are enough of them, otherwise
+// the snapshot can start over at the oldest live page.
+//
+// @access private
+// @param true to write over the current snapshot if needed
+// @return bool - false if the snapshot doesn't fit
+//
+bool FifteenStepJournal::_snapshot(bool reuse)
+{
+
+  unsigned long bytes = 0;
+  unsigned int payload = _size - FS_JOURNAL_HEADER;
+
+  _seq->serialize(_snapshotCount, &bytes);
+
+  // snapshot pages plus the first edit page
+  unsigned long needed = (bytes + payload - 1) / payload + 1;
+
+  if(needed > _pages)
+    return false;
+
+  // start over at the oldest page of the current snapshot
+  if(needed > _pages - _live()) {
+
+    if(! reuse)
+      return false;
+
+    _page = (_start + _pages - 1) % _pages;
+
+  }
+
+  _startPage(FS_PAGE_SNAPSHOT);
+
+  unsigned int first = _page;
+  unsigned int serial = _serial;
+
+  _seq->serialize(_snapshotWrite, this);
+
+  // the snapshot is complete, so it can be used now
+  _writeHeader(first, FS_PAGE_SNAPSHOT, serial);
+  _start = first;
+  _full = false;
+
+  _startPage(FS_PAGE_EDITS);
+
+  return true;
+
+}
+
+// _address
+//
+// Returns the storage address of an
+// offset inside of a page.
+//
+// @access private
+// @param page index
+// @param offset in the page
+// @return unsigned long
+//
+unsigned long FifteenStepJournal::_address(unsigned int page, unsigned int offset)
+{
+  return (unsigned long) page * _size + offset;
+}
+
+// _header
+//
+// Reads the header of a page.
+//
+// @access private
+// @param page index
+// @param set to the page type
+// @param set to the page serial number
+// @return bool - false if the page hasn't been written
+//
+bool FifteenStepJournal::_header(unsigned int page, byte &type, unsigned int &serial)
+{
+
+  byte header[FS_JOURNAL_HEADER];
+
+  _read_cb(_context, _address(page, 0), header, FS_JOURNAL_HEADER);
+
+  if(header[0] != FS_JOURNAL_MAGIC)
+    return false;
+
+  type = header[1];
+  serial = (header[2] << 8) | header[3];
+
+  return true;
+
+}
+
+// _writeHeader
+//
+// Writes the header of a page.
+//
+// @access private
+// @param page index
+// @param page type
+// @param page serial number
+// @return void
+//
+void FifteenStepJournal::_writeHeader(unsigned int page, byte type, unsigned int serial)
+{
+
+  byte header[FS_JOURNAL_HEADER] = {FS_JOURNAL_MAGIC, type, (byte) (serial >> 8), (byte) (serial & 0xFF)};
+
+  _write_cb(_context, _address(page, 0), header, FS_JOURNAL_HEADER);
+
+}
+
+// _startPage
+//
+// Moves to the next page in the ring and gets it ready to
+// be written. Flash pages are erased, and EEPROM edit pages
+// are filled with 0xFF so the end of the edits can be found.
+// Snapshot headers are cleared until the snapshot is done.
+//
+// @access private
+// @param page type
+// @return void
+//
+void FifteenStepJournal::_startPage(byte type)
+{
+
+  _page = (_page + 1) % _pages;
+  _serial = (_serial + 1) & 0xFFFF;
+  _offset = FS_JOURNAL_HEADER;
+
+  if(_erase_cb) {
+
+    _erase_cb(_context, _address(_page, 0));
+
+  } else if(type == FS_PAGE_EDITS) {
+
+    byte blank[FS_JOURNAL_ENTRY] = {0xFF, 0xFF, 0xFF, 0xFF};
+
+    for(unsigned int i = FS_JOURNAL_HEADER; i + FS_JOURNAL_ENTRY <= _size; i += FS_JOURNAL_ENTRY)
+      _write_cb(_context, _address(_page, i), blank, FS_JOURNAL_ENTRY);
+
+  }
+
+  if(type != FS_PAGE_SNAPSHOT) {
+    _writeHeader(_page, type, _serial);
+    return;
+  }
+
+  // make sure an old snapshot on this page isn't used
+  if(! _erase_cb) {
+    byte blank[FS_JOURNAL_HEADER] = {0x0, 0x0, 0x0, 0x0};
+    _write_cb(_context, _address(_page, 0), blank, FS_JOURNAL_HEADER);
+  }
+
+}
+
+// _snapshotWrite
+//
+// Write callback used with serialize to copy the snapshot
+// into storage, moving on to new pages as they fill up.
+//
+// @access private
+// @param the journal
+// @param serialized data
+// @param length of data
+// @return void
+//
+void FifteenStepJournal::_snapshotWrite(void* context, const byte* data, byte length)
+{
+
+  FifteenStepJournal* journal = (FifteenStepJournal*) context;
+
+  while(length > 0)
+  {
+
+    if(journal->_offset >= journal->_size)
+      journal->_startPage(FS_PAGE_DATA);
+
+    byte count = length;
+
+    if(count > journal->_size - journal->_offset)
+      count = journal->_size - journal->_offset;
+
+    journal->_write_cb(journal->_context, journal->_address(journal->_page, journal->_offset), data, count);
+
+    journal->_offset += count;
+    data += count;
+    length -= count;
+
+  }
+
+}
+
+// _snapshotCount
+//
+// Write callback used with serialize to find
+// the size of a snapshot before writing it.
+//
+// @access private
+// @param pointer to the byte count
+// @param serialized data, which isn't used
+// @param length of data
+// @return void
+//
+void FifteenStepJournal::_snapshotCount(void* context, const byte*, byte length)
+{
+  *((unsigned long*) context) += length;
+}
+
+// _snapshotRead
+//
+// Read callback used with deserialize to load a snapshot
+// from storage. Reading stops at the first page that isn't
+// the next data page of the same snapshot.
+//
+// @access private
+// @param the journal
+// @param buffer to fill
+// @param size of buffer
+// @return byte - number of bytes read
+//
+byte FifteenStepJournal::_snapshotRead(void* context, byte* data, byte length)
+{
+
+  FifteenStepJournal* journal = (FifteenStepJournal*) context;
+  byte total = 0;
+
+  while(total < length)
+  {
+
+    if(journal->_offset >= journal->_size) {
+
+      unsigned int next = (journal->_page + 1) % journal->_pages;
+      byte type;
+      unsigned int serial;
+
+      if(! journal->_header(next, type, serial) || type != FS_PAGE_DATA)
+        break;
+
+      if(serial != ((journal->_serial + 1) & 0xFFFF))
+        break;
+
+      journal->_page = next;
+      journal->_serial = serial;
+      journal->_offset = FS_JOURNAL_HEADER;
+
+    }
+
+    byte count = length - total;
+
+    if(count > journal->_size - journal->_offset)
+      count = journal->_size - journal->_offset;
+
+    journal->_read_cb(journal->_context, journal->_address(journal->_page, journal->_offset), data + total, count);
+
+    journal->_offset += count;
+    total += count;
+
+  }
+
+  return total;
+
+}
@@ -0,0 +1,83 @@
+// ---------------------------------------------------------------------------
+//
+// FifteenStepJournal.h
+// Wear leveled pattern storage for the FifteenStep sequencer.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#ifndef _FifteenStepJournal_h
+#define _FifteenStepJournal_h
+
+#include "FifteenStep.h"
+
+#define FS_JOURNAL_MAGIC 0xA5
+#define FS_JOURNAL_HEADER 4
+#define FS_JOURNAL_ENTRY 4
+#define FS_PAGE_SNAPSHOT 'S'
+#define FS_PAGE_DATA 'D'
+#define FS_PAGE_EDITS 'E'
+
+// StorageReadCallback
+//
+// This defines the format of the callback the journal uses to
+// read from EEPROM or flash. The callback should copy length
+// bytes starting at address into data.
+//
+typedef void (*StorageReadCallback) (void* context, unsigned long address, byte* data, byte length);
+
+// StorageWriteCallback
+//
+// This defines the format of the callback the journal uses to
+// write to EEPROM or flash. The callback should copy length
+// bytes from data to the storage starting at address.
+//
+typedef void (*StorageWriteCallback) (void* context, unsigned long address, const byte* data, byte length);
+
+// StorageEraseCallback
+//
+// This defines the format of the optional callback used to erase
+// a page of flash before it is written. Erased bytes should read
+// back as 0xFF. EEPROM doesn't need to be erased, so this can be
+// left out and the journal will clear pages itself.
+//
+typedef void (*StorageEraseCallback) (void* context, unsigned long address);
+
+class FifteenStepJournal
+{
+  friend class FifteenStep;
+  public:
+    FifteenStepJournal(unsigned int pages, unsigned int size, StorageReadCallback read, StorageWriteCallback write, StorageEraseCallback erase = NULL, void* context = NULL);
+    bool  begin(FifteenStep &seq);
+    void  record(byte channel, byte pitch, byte velocity, byte step);
+    bool  compact();
+    bool  full();
+  private:
+    FifteenStep*          _seq;
+    StorageReadCallback   _read_cb;
+    StorageWriteCallback  _write_cb;
+    StorageEraseCallback  _erase_cb;
+    void*                 _context;
+    bool                  _restoring;
+    bool                  _full;
+    unsigned int          _pages;
+    unsigned int          _size;
+    unsigned int          _start;
+    unsigned int          _page;
+    unsigned int          _offset;
+    unsigned int          _serial;
+    unsigned int          _live();
+    bool                  _fits(unsigned int count);
+    bool                  _snapshot(bool reuse);
+    unsigned long         _address(unsigned int page, unsigned int offset);
+    bool                  _header(unsigned int page, byte &type, unsigned int &serial);
+    void                  _startPage(byte type);
+    void                  _writeHeader(unsigned int page, byte type, unsigned int serial);
+    static void           _snapshotWrite(void* context, const byte* data, byte length);
+    static void           _snapshotCount(void* context, const byte* data, byte length);
+    static byte           _snapshotRead(void* context, byte* data, byte length);
+};
+
+#endif
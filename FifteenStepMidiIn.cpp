@@ -0,0 +1,256 @@
+// ---------------------------------------------------------------------------
+//
+// FifteenStepMidiIn.cpp
+// MIDI input parser for recording into the FifteenStep sequencer.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStepMidiIn.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            CONSTRUCTORS                                   //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// FifteenStepMidiIn
+//
+// Sets up a MIDI input parser that records the note on
+// and note off messages it receives into the passed
+// sequencer.
+//
+// @access public
+// @param the sequencer to record into
+//
+FifteenStepMidiIn::FifteenStepMidiIn(FifteenStep &seq)
+{
+
+  _seq = &seq;
+  _head = 0;
+  _tail = 0;
+  _status = 0;
+  _data = 0;
+  _count = 0;
+  _sysex = false;
+
+  for(byte i = 0; i < FS_MIDI_IN_HELD; ++i)
+    _held[i] = DEFAULT_NOTE;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            PUBLIC METHODS                                 //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// parse
+//
+// Passes one byte of incoming MIDI data to the parser. Running
+// status is supported, real time messages can be mixed in with
+// other messages, and SysEx data is skipped. Completed note
+// messages are tagged with the current quantized step and added
+// to a small queue, so each byte takes the same short amount of
+// time. This makes it safe to call from a serial receive
+// interrupt, or from loop() without holding up run().
+//
+// @access public
+// @param the received byte
+// @return void
+//
+void FifteenStepMidiIn::parse(byte data)
+{
+
+  // real time messages don't affect running status
+  if(data >= 0xF8)
+    return;
+
+  if(data & 0x80) {
+
+    _sysex = data == 0xF0;
+    _count = 0;
+
+    // system common messages cancel running status
+    _status = data < 0xF0 ? data : 0;
+
+    return;
+
+  }
+
+  // ignore data without a status, and sysex data
+  if(! _status || _sysex)
+    return;
+
+  byte type = _status & 0xF0;
+
+  // program change and channel pressure only have one data byte
+  if(type == 0xC0 || type == 0xD0)
+    return;
+
+  // wait for the second data byte
+  if(_count == 0) {
+    _data = data;
+    _count = 1;
+    return;
+  }
+
+  _count = 0;
+
+  if(type == 0x90)
+    _push(_status & 0x0F, _data, data);
+  else if(type == 0x80)
+    _push(_status & 0x0F, _data, 0);
+
+}
+
+// record
+//
+// Stores the queued notes in the sequence. This should be
+// called from loop(), since storing notes changes the sequence.
+// All of the queued notes are stored as one edit, so they are
+// merged into the sequence in one pass.
+// Note offs that land on the same step as their note on are
+// moved to the next step, so every recorded note gets a note
+// off after it.
+//
+// @access public
+// @return void
+//
+void FifteenStepMidiIn::record()
+{
+
+  // nothing to do
+  if(_tail == _head)
+    return;
+
+  // sort once for everything that was queued
+  _seq->beginEdit();
+
+  while(_tail != _head)
+  {
+
+    FifteenStepNote note = _queue[_tail];
+    _tail = (_tail + 1) & (FS_MIDI_IN_QUEUE - 1);
+
+    if(note.velocity > 0)
+      _hold(note.channel, note.pitch, note.step);
+    else
+      note.step = _release(note.channel, note.pitch, note.step);
+
+    _seq->setNote(note.channel, note.pitch, note.velocity, note.step);
+
+  }
+
+  _seq->commitEdit();
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            PRIVATE METHODS                                //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// _push
+//
+// Adds a note to the queue, along with the quantized
+// step it was received on. The note is dropped if the
+// queue is full.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param velocity of note, zero for note off
+// @return void
+//
+void FifteenStepMidiIn::_push(byte channel, byte pitch, byte velocity)
+{
+
+  byte next = (_head + 1) & (FS_MIDI_IN_QUEUE - 1);
+
+  // full
+  if(next == _tail)
+    return;
+
+  _queue[_head].channel = channel;
+  _queue[_head].pitch = pitch;
+  _queue[_head].velocity = velocity;
+  _queue[_head].step = _seq->getPosition();
+
+  _head = next;
+
+}
+
+// _hold
+//
+// Remembers the step a note on was stored on, so the
+// matching note off can be kept after it. The oldest
+// slot is reused if too many notes are held.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param step the note on was stored on
+// @return void
+//
+void FifteenStepMidiIn::_hold(byte channel, byte pitch, byte step)
+{
+
+  byte slot = FS_MIDI_IN_HELD - 1;
+
+  for(byte i = 0; i < FS_MIDI_IN_HELD; ++i)
+  {
+
+    if(_held[i].pitch == 0 || (_held[i].pitch == pitch && _held[i].channel == channel)) {
+      slot = i;
+      break;
+    }
+
+  }
+
+  _held[slot].channel = channel;
+  _held[slot].pitch = pitch;
+  _held[slot].step = step;
+
+}
+
+// _release
+//
+// Finds the held note that matches a note off and
+// returns the step the note off should be stored on.
+//
+// @access private
+// @param channel of note
+// @param pitch of note
+// @param quantized step of the note off
+// @return byte - step to store the note off on
+//
+byte FifteenStepMidiIn::_release(byte channel, byte pitch, byte step)
+{
+
+  for(byte i = 0; i < FS_MIDI_IN_HELD; ++i)
+  {
+
+    if(_held[i].pitch != pitch || _held[i].channel != channel)
+      continue;
+
+    byte start = _held[i].step;
+    _held[i] = DEFAULT_NOTE;
+
+    // move the note off past the note on. the step count
+    // is a byte, so all 256 steps reads back as zero
+    if(step == start) {
+      int steps = _seq->getSteps();
+      return (step + 1) % (steps > 0 ? steps : FS_MAX_STEPS);
+    }
+
+    break;
+
+  }
+
+  return step;
+
+}
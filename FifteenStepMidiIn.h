@@ -0,0 +1,41 @@
+// ---------------------------------------------------------------------------
+//
+// FifteenStepMidiIn.h
+// MIDI input parser for recording into the FifteenStep sequencer.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#ifndef _FifteenStepMidiIn_h
+#define _FifteenStepMidiIn_h
+
+#include "FifteenStep.h"
+
+// must be a power of two
+#define FS_MIDI_IN_QUEUE 16
+#define FS_MIDI_IN_HELD 8
+
+class FifteenStepMidiIn
+{
+  public:
+    FifteenStepMidiIn(FifteenStep &seq);
+    void  parse(byte data);
+    void  record();
+  private:
+    FifteenStep*      _seq;
+    FifteenStepNote   _queue[FS_MIDI_IN_QUEUE];
+    FifteenStepNote   _held[FS_MIDI_IN_HELD];
+    volatile byte     _head;
+    volatile byte     _tail;
+    byte              _status;
+    byte              _data;
+    byte              _count;
+    bool              _sysex;
+    void              _push(byte channel, byte pitch, byte velocity);
+    void              _hold(byte channel, byte pitch, byte step);
+    byte              _release(byte channel, byte pitch, byte step);
+};
+
+#endif
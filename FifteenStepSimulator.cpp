@@ -0,0 +1,253 @@
+// ---------------------------------------------------------------------------
+//
+// FifteenStepSimulator.cpp
+// Virtual clock simulation for the FifteenStep sequencer.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStepSimulator.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            CONSTRUCTORS                                   //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// FifteenStepSimulator
+//
+// Sets up a simulation of the passed sequencer. The
+// sequencer's clock source and MIDI handler are replaced,
+// so that time only moves forward when advance() is called,
+// and all MIDI output is sent to the event handler along
+// with the virtual time it was sent.
+//
+// @access public
+// @param the sequencer to simulate
+//
+FifteenStepSimulator::FifteenStepSimulator(FifteenStep &seq)
+{
+
+  _seq = &seq;
+  _event_cb = NULL;
+  _event_context = NULL;
+  _time = 0;
+  _micros = 0;
+
+  _seq->setClockSource(_clock, this);
+  _seq->setMidiHandler(_midi, this);
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            PUBLIC METHODS                                 //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// setEventHandler
+//
+// Allows user to set the callback that will receive the
+// timestamped MIDI output of the sequencer.
+//
+// @access public
+// @param the callback that will receive events
+// @param user data passed to the callback
+// @return void
+//
+void FifteenStepSimulator::setEventHandler(EventCallback cb, void* context)
+{
+  _event_cb = cb;
+  _event_context = context;
+}
+
+// setTime
+//
+// Sets the virtual time in milliseconds without
+// running the sequencer.
+//
+// @access public
+// @param the new time
+// @return void
+//
+void FifteenStepSimulator::setTime(unsigned long time)
+{
+  _time = time;
+  _micros = 0;
+}
+
+// getTime
+//
+// Returns the virtual time in milliseconds.
+//
+// @access public
+// @return unsigned long
+//
+unsigned long FifteenStepSimulator::getTime()
+{
+  return _time;
+}
+
+// getMicros
+//
+// Returns the virtual time in microseconds. Like micros()
+// on a board, this wraps around about every 71 minutes.
+//
+// @access public
+// @return unsigned long
+//
+unsigned long FifteenStepSimulator::getMicros()
+{
+  return _time * 1000 + _micros;
+}
+
+// advance
+//
+// Runs the sequencer for the passed amount of virtual time.
+// Instead of calling run() once per millisecond, the clock
+// jumps straight to the next step, clock tick, or scheduled
+// event, so long stretches of sequencing can be simulated
+// as fast as the CPU allows.
+//
+// @access public
+// @param time to simulate in milliseconds
+// @return void
+//
+void FifteenStepSimulator::advance(unsigned long duration)
+{
+
+  unsigned long end = _time + duration;
+
+  while(_seq->_running)
+  {
+
+    // find the next time something will happen
+    unsigned long next = _seq->_next_beat;
+
+    if((long) (_seq->_next_clock - next) < 0)
+      next = _seq->_next_clock;
+
+    for(byte i = 0; i < _seq->_queue_count; ++i)
+    {
+      if((long) (_seq->_queue[i].time - next) < 0)
+        next = _seq->_queue[i].time;
+    }
+
+    // nothing left to do in this window
+    if((long) (next - end) > 0)
+      break;
+
+    // don't move backwards in time
+    if((long) (next - _time) > 0) {
+      _time = next;
+      _micros = 0;
+    }
+
+    _seq->run();
+
+  }
+
+  _time = end;
+  _micros = 0;
+
+}
+
+// poll
+//
+// Runs the sequencer the way a sketch's loop() would. run()
+// is called once per loop, and the virtual clock then moves
+// forward by the time the workload callback says the rest of
+// the loop took. Steps and clock ticks land late whenever the
+// loop is busy, which shows how much timing jitter a sketch
+// will have on a real board. This is much slower than
+// advance(), since every pass through the loop is simulated.
+//
+// @access public
+// @param time to simulate in milliseconds
+// @param callback that returns the microseconds each loop takes
+// @param user data passed to the callback
+// @return void
+//
+void FifteenStepSimulator::poll(unsigned long duration, WorkloadCallback workload, void* context)
+{
+
+  unsigned long end = _time + duration;
+
+  while((long) (end - _time) > 0)
+  {
+
+    _seq->run();
+
+    unsigned long cost = 0;
+
+    if(workload)
+      cost = workload(context);
+
+    // every pass through the loop takes some time
+    if(cost < 1)
+      cost = 1;
+
+    _micros += cost;
+    _time += _micros / 1000;
+    _micros %= 1000;
+
+  }
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            PRIVATE METHODS                                //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// _clock
+//
+// The clock source given to the sequencer.
+//
+// @access private
+// @param the simulator
+// @return unsigned long - virtual time
+//
+unsigned long FifteenStepSimulator::_clock(void* context)
+{
+  return ((FifteenStepSimulator*) context)->_time;
+}
+
+// _midi
+//
+// The MIDI handler given to the sequencer. Events are
+// passed on to the event handler with the virtual time.
+//
+// @access private
+// @param the simulator
+// @param channel
+// @param command
+// @param first argument
+// @param second argument
+// @return void
+//
+void FifteenStepSimulator::_midi(void* context, byte channel, byte command, byte arg1, byte arg2)
+{
+
+  FifteenStepSimulator* sim = (FifteenStepSimulator*) context;
+
+  if(! sim->_event_cb)
+    return;
+
+  FifteenStepEvent event;
+
+  event.time = sim->_time;
+  event.channel = channel;
+  event.command = command;
+  event.arg1 = arg1;
+  event.arg2 = arg2;
+  event.repeats = 0;
+  event.decay = 0;
+  event.interval = 0;
+
+  sim->_event_cb(sim->_event_context, event);
+
+}
@@ -0,0 +1,54 @@
+// ---------------------------------------------------------------------------
+//
+// FifteenStepSimulator.h
+// Virtual clock simulation for the FifteenStep sequencer.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#ifndef _FifteenStepSimulator_h
+#define _FifteenStepSimulator_h
+
+#include "FifteenStep.h"
+
+// EventCallback
+//
+// This defines the format of the callback that receives the
+// MIDI output of a simulated sequencer. Each event includes the
+// virtual time in milliseconds that it was sent.
+//
+typedef void (*EventCallback) (void* context, const FifteenStepEvent &event);
+
+// WorkloadCallback
+//
+// This defines the format of the callback that stands in for
+// the rest of a sketch's loop() when polling. It should return
+// the number of microseconds that the loop spends outside of
+// run(), such as the time taken by display writes or radio
+// updates.
+//
+typedef unsigned long (*WorkloadCallback) (void* context);
+
+class FifteenStepSimulator
+{
+  public:
+    FifteenStepSimulator(FifteenStep &seq);
+    void  setEventHandler(EventCallback cb, void* context = NULL);
+    void  setTime(unsigned long time);
+    void  advance(unsigned long duration);
+    void  poll(unsigned long duration, WorkloadCallback workload, void* context = NULL);
+    unsigned long getTime();
+    unsigned long getMicros();
+  private:
+    FifteenStep*    _seq;
+    EventCallback   _event_cb;
+    void*           _event_context;
+    unsigned long   _time;
+    unsigned long   _micros;
+    static unsigned long _clock(void* context);
+    static void     _midi(void* context, byte channel, byte command, byte arg1, byte arg2);
+};
+
+#endif
@@ -13,7 +13,7 @@
 #include "FifteenStep.h"
 
 // sequencer init
-FifteenStep seq = FifteenStep();
+FifteenStep seq;
 
 // save button state
 int button_last = 0;
@@ -0,0 +1,184 @@
+// ---------------------------------------------------------------------------
+//
+// benchmark.cpp
+//
+// A host benchmark for the sequencer hot paths. setNote, the heap sort,
+// note triggering, setSteps and quantization are timed as the sequence
+// grows from 128 to 4096 slots, and as occupancy goes from sparse to full.
+// The full rows leave one slot free, so setNote still has to store the
+// note instead of dropping it.
+// Results are printed in nanoseconds per operation along with the number
+// of note comparisons each operation makes.
+//
+// Build it on Linux with CMake from the root of the library:
+//
+//   cmake -S . -B build && cmake --build build && ./build/benchmark
+//
+// See examples/benchmark_cycles for measuring cycles on a board.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include <stdio.h>
+#include <chrono>
+#include "FifteenStep.h"
+
+#define STEPS 64
+
+// gives the benchmark access to the private hot paths
+class FifteenStepBenchmark
+{
+  public:
+
+    // fill a number of slots with notes and sort them once
+    static void fill(FifteenStep &seq, int count)
+    {
+
+      unsigned long seed = 1;
+
+      for(int i = 0; i < count && i < seq._sequence_size; ++i)
+      {
+
+        seed = seed * 1103515245UL + 12345UL;
+
+        seq._sequence[i].channel = (seed >> 8) % 15;
+        seq._sequence[i].pitch = 1 + (seed >> 12) % 126;
+        seq._sequence[i].velocity = (seed >> 20) % 2 ? 100 : 0;
+        seq._sequence[i].step = (seed >> 24) % STEPS;
+
+      }
+
+      seq._heapSort();
+
+    }
+
+    static void sort(FifteenStep &seq)
+    {
+      seq._heapSort();
+    }
+
+    static void trigger(FifteenStep &seq, byte position)
+    {
+      seq._position = position;
+      seq._triggerNotes();
+    }
+
+    static int quantize(FifteenStep &seq)
+    {
+      return seq._quantizedPosition();
+    }
+
+    static unsigned long comparisons(FifteenStep &seq)
+    {
+      return seq._comparisons;
+    }
+
+    static void reset(FifteenStep &seq)
+    {
+      seq._comparisons = 0;
+    }
+
+};
+
+typedef std::chrono::steady_clock timer;
+
+// keeps the compiler from skipping work
+volatile unsigned long sink = 0;
+
+unsigned long now(void*) {
+  return 0;
+}
+
+void midi(byte, byte, byte arg1, byte) {
+  sink += arg1;
+}
+
+void report(int slots, int percent, const char* name, double ns, double compares) {
+  printf("%6d %6d%%  %-12s %12.1f %12.1f\n", slots, percent, name, ns, compares);
+}
+
+int main() {
+
+  int sizes[] = {128, 256, 512, 1024, 2048, 4096};
+  int occupancy[] = {5, 25, 50, 100};
+
+  printf("%6s %7s  %-12s %12s %12s\n", "slots", "used", "operation", "ns/op", "compares/op");
+
+  for(unsigned s = 0; s < sizeof(sizes) / sizeof(int); ++s)
+  {
+
+    for(unsigned o = 0; o < sizeof(occupancy) / sizeof(int); ++o)
+    {
+
+      int slots = sizes[s];
+      int iterations = 262144 / slots;
+      FifteenStep seq(slots * sizeof(FifteenStepNote));
+
+      seq.setClockSource(now);
+      seq.setMidiHandler(midi);
+      seq.begin(120, STEPS);
+
+      int notes = slots * occupancy[o] / 100;
+
+      // a full sequence would only time dropping the note
+      if(notes >= slots)
+        notes = slots - 1;
+
+      FifteenStepBenchmark::fill(seq, notes);
+
+      // setNote, toggling the same note on and off
+      FifteenStepBenchmark::reset(seq);
+      timer::time_point start = timer::now();
+
+      for(int i = 0; i < iterations; ++i)
+        seq.setNote(15, 127, 100, i % STEPS);
+
+      double ns = std::chrono::duration<double, std::nano>(timer::now() - start).count();
+      report(slots, occupancy[o], "setNote", ns / iterations, (double) FifteenStepBenchmark::comparisons(seq) / iterations);
+
+      // heap sort of an already sorted sequence
+      FifteenStepBenchmark::reset(seq);
+      start = timer::now();
+
+      for(int i = 0; i < iterations; ++i)
+        FifteenStepBenchmark::sort(seq);
+
+      ns = std::chrono::duration<double, std::nano>(timer::now() - start).count();
+      report(slots, occupancy[o], "heapSort", ns / iterations, (double) FifteenStepBenchmark::comparisons(seq) / iterations);
+
+      // triggering the notes of one step
+      start = timer::now();
+
+      for(int i = 0; i < iterations; ++i)
+        FifteenStepBenchmark::trigger(seq, i % STEPS);
+
+      ns = std::chrono::duration<double, std::nano>(timer::now() - start).count();
+      report(slots, occupancy[o], "triggerNotes", ns / iterations, 0);
+
+      // setSteps without clearing anything
+      start = timer::now();
+
+      for(int i = 0; i < iterations; ++i)
+        seq.setSteps(STEPS);
+
+      ns = std::chrono::duration<double, std::nano>(timer::now() - start).count();
+      report(slots, occupancy[o], "setSteps", ns / iterations, 0);
+
+      // quantizing the current time
+      start = timer::now();
+
+      for(int i = 0; i < iterations; ++i)
+        sink += FifteenStepBenchmark::quantize(seq);
+
+      ns = std::chrono::duration<double, std::nano>(timer::now() - start).count();
+      report(slots, occupancy[o], "quantize", ns / iterations, 0);
+
+    }
+
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,234 @@
+// ---------------------------------------------------------------------------
+//
+// benchmark_cycles.ino
+//
+// Measures the sequencer hot paths on a board in CPU cycles. The cycle
+// counter in the DWT unit is used on Cortex-M3 and M4 boards, Timer1 is
+// used on AVR boards, and micros() is used everywhere else. Results are
+// printed to the serial monitor for each sequence size, along with the
+// share of a sixteenth note at the maximum tempo that each operation uses.
+// The full rows leave one slot free, so setNote still stores its note.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStep.h"
+
+#define STEPS 64
+#define RUNS 16
+
+// gives the benchmark access to the private hot paths
+class FifteenStepBenchmark
+{
+  public:
+
+    static void fill(FifteenStep &seq, int count)
+    {
+
+      for(int i = 0; i < count && i < seq._sequence_size; ++i)
+      {
+        seq._sequence[i].channel = random(15);
+        seq._sequence[i].pitch = random(1, 127);
+        seq._sequence[i].velocity = random(2) ? 100 : 0;
+        seq._sequence[i].step = random(STEPS);
+      }
+
+      seq._heapSort();
+
+    }
+
+    static void sort(FifteenStep &seq)
+    {
+      seq._heapSort();
+    }
+
+    static void trigger(FifteenStep &seq, byte position)
+    {
+      seq._position = position;
+      seq._triggerNotes();
+    }
+
+};
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+
+  // cortex-m3 and m4 cycle counter
+  #define CYCLE_UNITS "cycles"
+  #define CYCLES_PER_US (F_CPU / 1000000UL)
+
+  void cycles_begin() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+
+  unsigned long cycles() {
+    return DWT->CYCCNT;
+  }
+
+#elif defined(__AVR__)
+
+  // timer1 runs at the cpu clock, and the
+  // overflow interrupt extends it to 32 bits
+  #define CYCLE_UNITS "cycles"
+  #define CYCLES_PER_US (F_CPU / 1000000UL)
+
+  volatile unsigned int overflows = 0;
+
+  ISR(TIMER1_OVF_vect) {
+    overflows++;
+  }
+
+  void cycles_begin() {
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+    TCNT1 = 0;
+    TIMSK1 = _BV(TOIE1);
+  }
+
+  unsigned long cycles() {
+
+    unsigned int high;
+    unsigned int low;
+
+    noInterrupts();
+
+    high = overflows;
+    low = TCNT1;
+
+    // overflow happened but hasn't been counted yet
+    if((TIFR1 & _BV(TOV1)) && low < 0x8000)
+      high++;
+
+    interrupts();
+
+    return ((unsigned long) high << 16) | low;
+
+  }
+
+#else
+
+  // no cycle counter, so time in microseconds
+  #define CYCLE_UNITS "us"
+  #define CYCLES_PER_US 1
+
+  void cycles_begin() {}
+
+  unsigned long cycles() {
+    return micros();
+  }
+
+#endif
+
+// sequence sizes to sweep, in slots
+int sizes[] = {128, 256, 512, 1024, 2048, 4096};
+
+// the largest size that fits in memory. AVR boards
+// only have room for the smaller sequences
+#if defined(__AVR__)
+  #define MAX_SLOTS 256
+#else
+  #define MAX_SLOTS 4096
+#endif
+
+void setup() {
+
+  Serial.begin(115200);
+
+  while(! Serial);
+
+  cycles_begin();
+
+  // the time between sixteenth notes at the maximum tempo
+  unsigned long budget = (60000000UL / FS_MAX_TEMPO / 4) * CYCLES_PER_US;
+
+  Serial.print(F("step budget: "));
+  Serial.print(budget);
+  Serial.println(F(" " CYCLE_UNITS));
+
+  int occupancy[] = {5, 25, 50, 100};
+
+  for(unsigned s = 0; s < sizeof(sizes) / sizeof(int); ++s)
+  {
+
+    int slots = sizes[s];
+
+    if(slots > MAX_SLOTS)
+      break;
+
+    FifteenStep* seq = new FifteenStep(slots * sizeof(FifteenStepNote));
+
+    // no MIDI handler, so triggering only walks the sequence.
+    // the sequencer has to be running for setNote to store notes
+    seq->begin(FS_MAX_TEMPO, STEPS);
+
+    for(int o = 0; o < 4; ++o)
+    {
+
+      int notes = slots * occupancy[o] / 100;
+
+      // a full sequence would only time dropping the note
+      if(notes >= slots)
+        notes = slots - 1;
+
+      seq->panic();
+      FifteenStepBenchmark::fill(*seq, notes);
+
+      Serial.print(slots);
+      Serial.print(F(" slots, "));
+      Serial.print(occupancy[o]);
+      Serial.println(F("% full"));
+
+      unsigned long start = cycles();
+
+      for(int i = 0; i < RUNS; ++i)
+        seq->setNote(15, 127, 100, i % STEPS);
+
+      report(F("setNote"), (cycles() - start) / RUNS, budget);
+
+      start = cycles();
+
+      for(int i = 0; i < RUNS; ++i)
+        FifteenStepBenchmark::sort(*seq);
+
+      report(F("heapSort"), (cycles() - start) / RUNS, budget);
+
+      start = cycles();
+
+      for(int i = 0; i < RUNS; ++i)
+        FifteenStepBenchmark::trigger(*seq, i % STEPS);
+
+      report(F("triggerNotes"), (cycles() - start) / RUNS, budget);
+
+      start = cycles();
+
+      for(int i = 0; i < RUNS; ++i)
+        seq->setSteps(STEPS);
+
+      report(F("setSteps"), (cycles() - start) / RUNS, budget);
+
+    }
+
+    delete seq;
+
+  }
+
+}
+
+void loop() {}
+
+// prints the cost of one operation and the
+// share of the step budget that it uses
+void report(const __FlashStringHelper* name, unsigned long cost, unsigned long budget) {
+
+  Serial.print(F("  "));
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(cost);
+  Serial.print(F(" " CYCLE_UNITS ", "));
+  Serial.print(100.0 * cost / budget, 2);
+  Serial.println(F("% of step"));
+
+}
@@ -40,7 +40,7 @@ Adafruit_BluefruitLE_SPI ble(BLUEFRUIT_SPI_CS, BLUEFRUIT_SPI_IRQ, BLUEFRUIT_SPI_
 #define IRQ_PIN  A4
 
 // sequencer, neopixel, & mpr121 init
-FifteenStep seq = FifteenStep(1024);
+FifteenStep seq(1024);
 Adafruit_NeoPixel pixels = Adafruit_NeoPixel(LEDS, NEO_PIN, NEO_GRB + NEO_KHZ800);
 Adafruit_MPR121 cap = Adafruit_MPR121();
 Adafruit_BLEMIDI blemidi(ble);
@@ -19,7 +19,7 @@
 #include "FifteenStep.h"
 
 #define SEQUENCER_MEMORY 512
-FifteenStep seq = FifteenStep(SEQUENCER_MEMORY);
+FifteenStep seq(SEQUENCER_MEMORY);
 
 // set initial state for dynamic values
 int tempo = 60;
@@ -70,9 +70,26 @@ void modeDisplay(int current) {
 
 }
 
+// draw one note on the grid. called by forEachNote
+void drawNote(void* context, byte ch, byte p, byte velocity, byte step) {
+
+  uint8_t y = pitchToCol(p);
+
+  // pitch isn't currently set
+  if(y == 255)
+    return;
+
+  uint8_t led = untztrument.xy2i(step % WIDTH, y);
+
+  if(velocity != 0)
+    untztrument.setLED(led);
+  else
+    untztrument.clrLED(led);
+
+}
+
 void noteDisplay(int current) {
 
-  int length = SEQUENCER_MEMORY / sizeof(FifteenStepNote);
   float c = (float) current / (float) WIDTH;
   int end = ceil(c) * WIDTH;
 
@@ -81,37 +98,21 @@ void noteDisplay(int current) {
 
   int start = end - WIDTH;
 
-  FifteenStepNote* _sequence = seq.getSequence();
+  // only visits the notes on this page
+  seq.forEachNote(start, end, channel, drawNote);
 
-  for(int i=0; i < length; ++i) {
-
-    // default state, skip.
-    if(_sequence[i].pitch == 0 && _sequence[i].velocity == 0 && _sequence[i].step == 0)
-      continue;
-
-    // if the current step isn't in the display range, skip
-    if(_sequence[i].step < start || _sequence[i].step >= end)
-      continue;
-
-    // if we are on a different channel, skip
-    if(channel != _sequence[i].channel)
-      continue;
-
-    uint8_t x = _sequence[i].step % WIDTH;
-    uint8_t y = pitchToCol(_sequence[i].pitch);
+}
 
-    // pitch isn't currently set
-    if(y == 255)
-      continue;
+// redraw the notes of one step
+void columnDisplay(int position) {
 
-    uint8_t led = untztrument.xy2i(x, y);
+  uint8_t x = position % WIDTH;
 
-    if(_sequence[i].velocity != 0)
-      untztrument.setLED(led);
-    else
-      untztrument.clrLED(led);
+  // clear the column first
+  for(uint8_t y=0; y<8; y++)
+    untztrument.clrLED(untztrument.xy2i(x, y));
 
-  }
+  seq.forEachNote(position, position + 1, channel, drawNote);
 
 }
 
@@ -0,0 +1,299 @@
+// ---------------------------------------------------------------------------
+//
+// jitter.cpp
+//
+// A host harness that measures timing jitter. The sequencer is polled the
+// way a sketch's loop() would call run(), while a simulated workload of
+// display writes, BLE updates and random stalls keeps the loop busy. Every
+// step, MIDI clock and note on is compared to where it falls on the ideal
+// grid, counting from the first step, and a histogram of the error is
+// printed with the p50, p99 and max values. Steps that run() skipped after
+// a stall show up as missing events and as error that keeps growing. The
+// ideal time of a note on is the ideal time of its step plus its trig
+// delay, which is found by rendering the same pattern on a virtual clock
+// first, so delayed notes and ratchet repeats are measured too. The time
+// between events is compared to the ideal spacing as well.
+//
+// Build it on Linux with CMake from the root of the library:
+//
+//   cmake -S . -B build && cmake --build build
+//   ./build/jitter [idle|display|ble|stalls|all] [tempo] [minutes]
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#include "FifteenStep.h"
+#include "FifteenStepSimulator.h"
+
+#define BUCKETS 20
+
+// the simulated loop() workload
+struct Workload {
+  bool display;
+  bool ble;
+  bool stalls;
+  unsigned long next_display;
+  unsigned long next_ble;
+  unsigned long seed;
+};
+
+// the timing of one kind of event
+struct Timing {
+  const char* name;
+  double interval;
+  unsigned long ideal;
+  unsigned long count;
+  long drift;
+  std::vector<long> errors;
+  std::vector<long> spacing;
+  unsigned long last;
+
+  Timing(const char* name) : name(name), interval(0), ideal(0), count(0), drift(0), last(0) {}
+};
+
+FifteenStep seq(1024);
+FifteenStepSimulator sim = FifteenStepSimulator(seq);
+
+Timing steps("step");
+Timing clocks("clock");
+Timing notes("note");
+
+// when the live run started
+unsigned long origin = 0;
+
+// the length of a step in the sequencer, in milliseconds
+unsigned long sixteenth = 0;
+
+// ideal note on times in microseconds from the start of
+// the run, queued by channel and pitch in playing order
+std::map<int, std::deque<unsigned long> > ideal_notes;
+
+// microseconds spent in loop() outside of run()
+unsigned long workload(void* context) {
+
+  Workload* w = (Workload*) context;
+  unsigned long now = sim.getMicros();
+
+  // reading buttons and other light work
+  unsigned long cost = 150;
+
+  // redraw a display every 40ms
+  if(w->display && (long) (now - w->next_display) >= 0) {
+    cost += 6000;
+    w->next_display = now + 40000;
+  }
+
+  // send a BLE update every 20ms
+  if(w->ble && (long) (now - w->next_ble) >= 0) {
+    cost += 2500;
+    w->next_ble = now + 20000;
+  }
+
+  // rare stalls of up to 25ms
+  if(w->stalls) {
+
+    w->seed = w->seed * 1103515245UL + 12345UL;
+
+    if(((w->seed >> 16) % 1000) == 0)
+      cost += 1000 + (w->seed >> 8) % 24000;
+
+  }
+
+  return cost;
+
+}
+
+// compares an event to its ideal time
+void record(Timing &t, unsigned long time, unsigned long ideal) {
+
+  t.drift = (long) (time - ideal);
+  t.errors.push_back(labs(t.drift));
+
+  // distance from the ideal spacing since the last event
+  if(t.count > 0 && t.interval > 0)
+    t.spacing.push_back(labs((long) (time - t.last - t.interval)));
+
+  t.last = time;
+  t.count++;
+
+}
+
+// compares the nth event to the nth point on the grid
+void record(Timing &t, unsigned long time) {
+  record(t, time, origin + (unsigned long) (t.count * t.interval + 0.5));
+}
+
+void step(int, int) {
+  record(steps, sim.getMicros());
+}
+
+void event(void*, const FifteenStepEvent &e) {
+
+  if(e.command == 0xF8) {
+    record(clocks, sim.getMicros());
+    return;
+  }
+
+  if(e.command != 0x9 || e.arg2 == 0)
+    return;
+
+  std::deque<unsigned long> &ideal = ideal_notes[(e.channel << 8) | e.arg1];
+
+  // a note on that render() didn't play
+  if(ideal.empty())
+    return;
+
+  record(notes, sim.getMicros(), origin + ideal.front());
+  ideal.pop_front();
+
+}
+
+// collects the ideal note on times. render() starts on the
+// first step, while a live run moves to the second step
+// first, so rendered step n lines up with live step n - 1
+void rendered(void*, unsigned long step, const FifteenStepEvent &e) {
+
+  if(e.command != 0x9 || e.arg2 == 0 || step == 0)
+    return;
+
+  // how far after its step the note was played
+  unsigned long offset = (e.time - step * sixteenth) * 1000UL;
+
+  ideal_notes[(e.channel << 8) | e.arg1].push_back((unsigned long) ((step - 1) * steps.interval + 0.5) + offset);
+
+}
+
+// prints the p50, p99 and max of a list of errors
+void summary(const char* name, std::vector<long> sorted) {
+
+  std::sort(sorted.begin(), sorted.end());
+
+  long p50 = sorted[sorted.size() / 2];
+  long p99 = sorted[sorted.size() * 99 / 100];
+  long max = sorted.back();
+
+  printf("  %-8s p50 %.3fms, p99 %.3fms, max %.3fms\n", name, p50 / 1000.0, p99 / 1000.0, max / 1000.0);
+
+}
+
+void report(Timing &t) {
+
+  if(t.errors.empty())
+    return;
+
+  std::vector<long> sorted = t.errors;
+  std::sort(sorted.begin(), sorted.end());
+
+  printf("\n%s: %lu of %lu events, drift %.3fms\n", t.name, t.count, t.ideal, t.drift / 1000.0);
+
+  summary("grid", t.errors);
+
+  if(! t.spacing.empty())
+    summary("spacing", t.spacing);
+
+  // count the grid error in 1ms buckets
+  unsigned long buckets[BUCKETS + 1] = {0};
+
+  for(size_t i = 0; i < sorted.size(); ++i)
+  {
+
+    if(sorted[i] / 1000 >= BUCKETS)
+      buckets[BUCKETS]++;
+    else
+      buckets[sorted[i] / 1000]++;
+
+  }
+
+  for(int i = 0; i <= BUCKETS; ++i)
+  {
+
+    if(buckets[i] == 0)
+      continue;
+
+    int bar = (int) (60.0 * buckets[i] / sorted.size() + 0.5);
+
+    if(i == BUCKETS)
+      printf("  %2d+ ms  %8lu ", BUCKETS, buckets[i]);
+    else
+      printf("  %2d-%-2d ms %7lu ", i, i + 1, buckets[i]);
+
+    for(int b = 0; b < bar; ++b)
+      putchar('#');
+
+    putchar('\n');
+
+  }
+
+}
+
+int main(int argc, char* argv[]) {
+
+  const char* mode = argc > 1 ? argv[1] : "all";
+  int tempo = argc > 2 ? atoi(argv[2]) : 120;
+  unsigned long minutes = argc > 3 ? atol(argv[3]) : 5;
+
+  Workload w = {false, false, false, 0, 0, 1};
+
+  w.display = ! strcmp(mode, "display") || ! strcmp(mode, "all");
+  w.ble = ! strcmp(mode, "ble") || ! strcmp(mode, "all");
+  w.stalls = ! strcmp(mode, "stalls") || ! strcmp(mode, "all");
+
+  seq.begin(tempo, 16);
+  seq.setStepHandler(step);
+  sim.setEventHandler(event);
+
+  for(int i = 0; i < 16; i += 2)
+    seq.setNote(9, 42, 80, i);
+
+  // a snare played 30ms late on the first step
+  seq.setMicrotiming(true);
+  seq.recordNote(9, 38, 100, 30000);
+
+  // and a kick with a ratchet on the fifth step
+  seq.setNote(9, 36, 100, 4);
+  seq.setRatchet(9, 36, 2, 4);
+
+  // ideal spacing of steps and clock ticks in microseconds
+  steps.interval = 60000000.0 / tempo / 4;
+  clocks.interval = 60000000.0 / tempo / 24;
+
+  // the number of each event that fit in the run
+  unsigned long duration = minutes * 60000000UL;
+
+  steps.ideal = (unsigned long) ceil(duration / steps.interval);
+  clocks.ideal = (unsigned long) ceil(duration / clocks.interval);
+
+  // the same pattern on a virtual clock gives the ideal note times
+  sixteenth = 60000UL / tempo / 4;
+  seq.render(duration / (steps.interval * 16) + 2, rendered);
+
+  for(std::map<int, std::deque<unsigned long> >::iterator i = ideal_notes.begin(); i != ideal_notes.end(); ++i)
+  {
+    for(size_t n = 0; n < i->second.size(); ++n)
+      notes.ideal += i->second[n] < duration;
+  }
+
+  origin = sim.getMicros();
+
+  sim.poll(minutes * 60000UL, workload, &w);
+
+  printf("workload: %s, tempo: %d, minutes: %lu\n", mode, tempo, minutes);
+  printf("error is measured from the ideal grid, and from the ideal spacing of each event\n");
+
+  report(steps);
+  report(clocks);
+  report(notes);
+
+  return 0;
+
+}
@@ -31,7 +31,7 @@
 #define IRQ_PIN  4
 
 // sequencer, neopixel, & mpr121 init
-FifteenStep seq = FifteenStep(1024);
+FifteenStep seq(1024);
 Adafruit_NeoPixel pixels = Adafruit_NeoPixel(LEDS, NEO_PIN, NEO_GRB + NEO_KHZ800);
 Adafruit_MPR121 cap = Adafruit_MPR121();
 
@@ -10,9 +10,15 @@
 // forward definitions
 bool commandMode();
 void noteDisplay(int current);
+void columnDisplay(int position);
 void modeDisplay(int current);
 void setPlayhead(uint8_t c, bool set);
 
+// the page and channel that are on the display, so
+// the whole grid is only redrawn when they change
+int display_page = -1;
+int display_channel = -1;
+
 // called when the step position changes. both the current
 // position and last are passed to the callback
 void step(int current, int last) {
@@ -20,11 +26,37 @@ void step(int current, int last) {
   if(commandMode()) {
     trellis.fill(0);
     modeDisplay(current);
+    display_page = -1;
     return;
   }
 
-  trellis.fill(0);
-  noteDisplay(current);
+  int page = current / WIDTH;
+
+  if(page != display_page || channel != display_channel) {
+
+    // redraw everything
+    trellis.fill(0);
+    noteDisplay(current);
+    seq.clearChanges();
+
+    display_page = page;
+    display_channel = channel;
+
+  } else {
+
+    // put back the notes under the old playhead
+    columnDisplay(last);
+
+    // and redraw any steps that were edited
+    int position;
+
+    while(seq.nextChange(position)) {
+      if(position / WIDTH == page)
+        columnDisplay(position);
+    }
+
+  }
+
   setPlayhead(current % WIDTH, true);
 
 }
@@ -0,0 +1,72 @@
+// ---------------------------------------------------------------------------
+//
+// simulate.cpp
+//
+// A host example that runs the sequencer on a virtual clock. An hour of
+// sequencing is simulated as fast as the CPU allows, and the timestamped
+// MIDI output is counted and printed.
+//
+// Build it on Linux with CMake from the root of the library:
+//
+//   cmake -S . -B build && cmake --build build && ./build/simulate
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include <stdio.h>
+#include <time.h>
+#include "FifteenStep.h"
+#include "FifteenStepSimulator.h"
+
+// event counts
+unsigned long notes = 0;
+unsigned long clocks = 0;
+unsigned long last = 0;
+
+// called with every MIDI event the sequencer sends
+void event(void*, const FifteenStepEvent &e) {
+
+  if(e.command == 0x9)
+    notes++;
+  else if(e.command == 0xF8)
+    clocks++;
+
+  last = e.time;
+
+}
+
+int main() {
+
+  FifteenStep seq(1024);
+  FifteenStepSimulator sim = FifteenStepSimulator(seq);
+
+  seq.begin(120, 16);
+  sim.setEventHandler(event);
+
+  // four on the floor with a shuffled hi-hat
+  for(int i = 0; i < 16; i += 4)
+    seq.setNote(9, 36, 100, i);
+
+  for(int i = 0; i < 16; i += 2) {
+    seq.setNote(9, 42, 80, i);
+    seq.setNote(9, 42, 0, i + 1);
+  }
+
+  seq.increaseShuffle();
+  seq.increaseShuffle();
+
+  clock_t start = clock();
+
+  // one hour of virtual time
+  sim.advance(60UL * 60UL * 1000UL);
+
+  double elapsed = (double) (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+  printf("simulated %lu ms in %.2f ms\n", sim.getTime(), elapsed);
+  printf("note ons: %lu, clocks: %lu, last event: %lu ms\n", notes, clocks, last);
+
+  return 0;
+
+}
@@ -0,0 +1,63 @@
+// ---------------------------------------------------------------------------
+//
+// arpeggiator.cpp
+// Host tests for the arpeggiator.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStep.h"
+#include "FifteenStepSimulator.h"
+#include "check.h"
+
+unsigned long note_ons = 0;
+bool in_range = true;
+
+void event(void*, const FifteenStepEvent &e) {
+
+  if(e.command != 0x9 || e.arg2 == 0)
+    return;
+
+  note_ons++;
+
+  if(e.arg1 > 127)
+    in_range = false;
+
+}
+
+// more octaves than the arpeggiator allows, with every note held
+void testTooManyOctaves() {
+
+  FifteenStep seq(256);
+  FifteenStepSimulator sim = FifteenStepSimulator(seq);
+
+  seq.begin(120, 16);
+  sim.setEventHandler(event);
+
+  for(byte i = 0; i < FS_ARP_NOTES; ++i)
+    seq.arpNoteOn(60 + i, 100);
+
+  note_ons = 0;
+
+  for(int mode = FS_ARP_UP; mode <= FS_ARP_PLAYED; ++mode) {
+    seq.setArpeggiator(mode, 32, 1, 0);
+    sim.advance(2000);
+  }
+
+  seq.setArpeggiator(FS_ARP_UP_DOWN, 255, 1, 0);
+  sim.advance(2000);
+
+  CHECK(note_ons > 0);
+  CHECK(in_range);
+
+}
+
+int main() {
+
+  testTooManyOctaves();
+
+  return failures > 0 ? 1 : 0;
+
+}
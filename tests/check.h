@@ -0,0 +1,31 @@
+// ---------------------------------------------------------------------------
+//
+// check.h
+// A minimal check macro for the host tests.
+//
+// Each test is a small program that exits with a non-zero status
+// if any of its checks fail, so CTest can run it without a test
+// framework.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#ifndef _check_h
+#define _check_h
+
+#include <stdio.h>
+
+static int failures = 0;
+
+// prints the failed condition and where it is, and keeps going
+#define CHECK(condition) \
+  do { \
+    if(! (condition)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while(0)
+
+#endif
@@ -0,0 +1,128 @@
+// ---------------------------------------------------------------------------
+//
+// journal.cpp
+// Host tests for the wear leveled journal.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStep.h"
+#include "FifteenStepJournal.h"
+#include "check.h"
+
+#define PAGES 8
+#define PAGE_SIZE 256
+
+// a fake EEPROM that counts the bytes written to it
+byte storage[PAGES * PAGE_SIZE];
+unsigned long written = 0;
+
+void storageRead(void*, unsigned long address, byte* data, byte length) {
+  for(byte i = 0; i < length; ++i)
+    data[i] = storage[address + i];
+}
+
+void storageWrite(void*, unsigned long address, const byte* data, byte length) {
+  for(byte i = 0; i < length; ++i)
+    storage[address + i] = data[i];
+  written += length;
+}
+
+unsigned long now(void*) {
+  return 0;
+}
+
+bool sameNotes(FifteenStep &a, FifteenStep &b) {
+
+  if(a.getCapacity() != b.getCapacity())
+    return false;
+
+  FifteenStepNote* first = a.getSequence();
+  FifteenStepNote* second = b.getSequence();
+
+  for(int i = 0; i < a.getCapacity(); ++i)
+  {
+    if(first[i].channel != second[i].channel || first[i].pitch != second[i].pitch ||
+       first[i].velocity != second[i].velocity || first[i].step != second[i].step)
+      return false;
+  }
+
+  return true;
+
+}
+
+// grouped edits are saved as journal entries, not snapshots
+void testEditsAreAppended() {
+
+  for(unsigned int i = 0; i < sizeof(storage); ++i)
+    storage[i] = 0xFF;
+
+  FifteenStep seq(256);
+  FifteenStepJournal journal(PAGES, PAGE_SIZE, storageRead, storageWrite);
+
+  seq.setClockSource(now);
+  seq.begin(120, 16);
+  journal.begin(seq);
+
+  written = 0;
+
+  // the way FifteenStepMidiIn records each note
+  for(byte i = 0; i < 8; ++i) {
+    seq.beginEdit();
+    seq.setNote(0, 60 + i, 100, i * 2);
+    seq.setNote(0, 60 + i, 0, i * 2 + 1);
+    seq.commitEdit();
+  }
+
+  CHECK(written == 16 * FS_JOURNAL_ENTRY);
+  CHECK(! journal.full());
+
+  // the restored sequence matches
+  FifteenStep copy(256);
+  FifteenStepJournal restore(PAGES, PAGE_SIZE, storageRead, storageWrite);
+
+  copy.setClockSource(now);
+  copy.begin(120, 16);
+
+  CHECK(restore.begin(copy));
+  CHECK(sameNotes(seq, copy));
+
+}
+
+// edits that toggle the same note more than once
+void testRepeatedEdits() {
+
+  FifteenStep seq(64);
+
+  seq.setClockSource(now);
+  seq.begin(120, 16);
+
+  seq.setNote(0, 60, 100, 0);
+
+  seq.beginEdit();
+  seq.setNote(0, 60, 90, 0);
+  seq.setNote(0, 60, 80, 0);
+  seq.setNote(0, 62, 100, 4);
+  seq.setNote(0, 62, 100, 4);
+  seq.setNote(0, 61, 70, 2);
+  seq.commitEdit();
+
+  FifteenStepNote* notes = seq.getSequence();
+  int last = seq.getCapacity() - 1;
+
+  CHECK(notes[last - 1].pitch == 60 && notes[last - 1].velocity == 80 && notes[last - 1].step == 0);
+  CHECK(notes[last].pitch == 61 && notes[last].velocity == 70 && notes[last].step == 2);
+  CHECK(notes[last - 2].velocity == 0 && notes[last - 2].pitch == 0);
+
+}
+
+int main() {
+
+  testEditsAreAppended();
+  testRepeatedEdits();
+
+  return failures > 0 ? 1 : 0;
+
+}
@@ -0,0 +1,51 @@
+// ---------------------------------------------------------------------------
+//
+// locks.cpp
+// Host tests for parameter locks.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStep.h"
+#include "check.h"
+
+unsigned long now(void*) {
+  return 0;
+}
+
+// counts the control changes sent by render()
+void countLocks(void* context, unsigned long, const FifteenStepEvent &event) {
+  if(event.command == 0xB)
+    (*(int*) context)++;
+}
+
+// locks outside the pattern or the MIDI data range are rejected
+void testRejectsInvalidLocks() {
+
+  FifteenStep seq(64);
+  int locks = 0;
+
+  seq.setClockSource(now);
+  seq.begin(120, 16);
+
+  CHECK(seq.setLock(0, 74, 100, 15));
+  CHECK(! seq.setLock(0, 74, 100, 16));
+  CHECK(! seq.setLock(0, 74, 100, 200));
+  CHECK(! seq.setLock(0, 128, 100, 0));
+  CHECK(! seq.setLock(0, 74, 128, 0));
+
+  seq.render(1, countLocks, &locks);
+
+  CHECK(locks == 1);
+
+}
+
+int main() {
+
+  testRejectsInvalidLocks();
+
+  return failures > 0 ? 1 : 0;
+
+}
@@ -0,0 +1,159 @@
+// ---------------------------------------------------------------------------
+//
+// midi.cpp
+// Host tests for Standard MIDI File import and export.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStep.h"
+#include "check.h"
+
+#define BUFFER_SIZE 2048
+
+// an in memory file that can be written, then read back
+struct Buffer
+{
+  byte data[BUFFER_SIZE];
+  int length;
+  int position;
+};
+
+void bufferWrite(void* context, const byte* data, byte length) {
+
+  Buffer* buffer = (Buffer*) context;
+
+  for(byte i = 0; i < length && buffer->length < BUFFER_SIZE; ++i)
+    buffer->data[buffer->length++] = data[i];
+
+}
+
+byte bufferRead(void* context, byte* data, byte length) {
+
+  Buffer* buffer = (Buffer*) context;
+  byte count = 0;
+
+  while(count < length && buffer->position < buffer->length)
+    data[count++] = buffer->data[buffer->position++];
+
+  return count;
+
+}
+
+unsigned long now(void*) {
+  return 0;
+}
+
+// counts the control changes sent by render()
+void countLocks(void* context, unsigned long, const FifteenStepEvent &event) {
+  if(event.command == 0xB)
+    (*(int*) context)++;
+}
+
+bool sameDump(Buffer &a, Buffer &b) {
+
+  if(a.length != b.length)
+    return false;
+
+  for(int i = 0; i < a.length; ++i)
+  {
+    if(a.data[i] != b.data[i])
+      return false;
+  }
+
+  return true;
+
+}
+
+void fill(FifteenStep &seq, byte pitch, int notes) {
+
+  for(int i = 0; i < notes / 2; ++i) {
+    seq.setNote(i % 4, pitch + i / 16, 100, i % 16);
+    seq.setNote(i % 4, pitch + i / 16, 0, (i + 1) % 16);
+  }
+
+}
+
+// a file that is cut short or doesn't fit leaves the pattern alone
+void testFailedImport() {
+
+  FifteenStep source(256);
+  FifteenStep seq(256);
+  Buffer file = {{0}, 0, 0};
+  Buffer before = {{0}, 0, 0};
+  Buffer after = {{0}, 0, 0};
+
+  source.setClockSource(now);
+  source.begin(90, 16);
+  fill(source, 40, 20);
+  source.exportMidi(bufferWrite, &file);
+
+  seq.setClockSource(now);
+  seq.begin(140, 16);
+  fill(seq, 60, 60);
+  seq.serialize(bufferWrite, &before);
+
+  for(int length = 0; length < file.length; ++length) {
+
+    Buffer truncated = file;
+
+    truncated.length = length;
+
+    CHECK(! seq.importMidi(bufferRead, &truncated));
+
+  }
+
+  file.position = 0;
+  CHECK(! seq.importMidi(bufferRead, &file));
+
+  seq.serialize(bufferWrite, &after);
+
+  CHECK(sameDump(before, after));
+
+}
+
+// an import clears the undo log and locks with the old notes
+void testImportClearsPattern() {
+
+  FifteenStep source(256);
+  FifteenStep seq(256);
+  Buffer file = {{0}, 0, 0};
+  int locks = 0;
+
+  source.setClockSource(now);
+  source.begin(120, 16);
+  source.setNote(0, 60, 100, 0);
+  source.setNote(0, 60, 0, 2);
+  source.exportMidi(bufferWrite, &file);
+
+  seq.setClockSource(now);
+  seq.begin(120, 16);
+  fill(seq, 40, 10);
+  seq.setLock(0, 74, 100, 3);
+
+  // the same note as the file, so undo could find it again
+  seq.setOverdub(true);
+  seq.setNote(0, 60, 100, 0);
+  seq.setOverdub(false);
+
+  CHECK(seq.importMidi(bufferRead, &file));
+  CHECK(seq.getUsedSlots() == 2);
+  CHECK(seq.undoLastPass() == 0);
+  CHECK(seq.getUsedSlots() == 2);
+
+  seq.render(1, countLocks, &locks);
+
+  CHECK(locks == 0);
+
+}
+
+int main() {
+
+  testFailedImport();
+  testImportClearsPattern();
+
+  return failures > 0 ? 1 : 0;
+
+}
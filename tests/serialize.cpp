@@ -0,0 +1,195 @@
+// ---------------------------------------------------------------------------
+//
+// serialize.cpp
+// Host tests for saving and loading sequences.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStep.h"
+#include "check.h"
+
+#define BUFFER_SIZE 1024
+
+// an in memory file that can be written, then read back
+struct Buffer
+{
+  byte data[BUFFER_SIZE];
+  int length;
+  int position;
+};
+
+void bufferWrite(void* context, const byte* data, byte length) {
+
+  Buffer* buffer = (Buffer*) context;
+
+  for(byte i = 0; i < length && buffer->length < BUFFER_SIZE; ++i)
+    buffer->data[buffer->length++] = data[i];
+
+}
+
+byte bufferRead(void* context, byte* data, byte length) {
+
+  Buffer* buffer = (Buffer*) context;
+  byte count = 0;
+
+  while(count < length && buffer->position < buffer->length)
+    data[count++] = buffer->data[buffer->position++];
+
+  return count;
+
+}
+
+// collects the messages of a SysEx dump one after another
+void sysexWrite(void* context, const byte* data, byte length) {
+  bufferWrite(context, data, length);
+}
+
+unsigned long now(void*) {
+  return 0;
+}
+
+bool sameDump(Buffer &a, Buffer &b) {
+
+  if(a.length != b.length)
+    return false;
+
+  for(int i = 0; i < a.length; ++i)
+  {
+    if(a.data[i] != b.data[i])
+      return false;
+  }
+
+  return true;
+
+}
+
+// a pattern that fills most of a 64 slot sequence
+void fill(FifteenStep &seq, byte pitch, int notes) {
+
+  for(int i = 0; i < notes / 2; ++i) {
+    seq.setNote(i % 4, pitch + i / 16, 100, i % 16);
+    seq.setNote(i % 4, pitch + i / 16, 0, (i + 1) % 16);
+  }
+
+}
+
+// a load that is cut short leaves the sequence alone
+void testTruncatedLoad() {
+
+  FifteenStep source(256);
+  FifteenStep seq(256);
+  Buffer saved = {{0}, 0, 0};
+  Buffer before = {{0}, 0, 0};
+  Buffer after = {{0}, 0, 0};
+
+  source.setClockSource(now);
+  source.begin(90, 16);
+  fill(source, 40, 40);
+  source.serialize(bufferWrite, &saved);
+
+  seq.setClockSource(now);
+  seq.begin(140, 16);
+  seq.increaseShuffle();
+  fill(seq, 60, 60);
+  seq.serialize(bufferWrite, &before);
+
+  CHECK(seq.getUsedSlots() == 60);
+
+  for(int length = 0; length < saved.length; ++length) {
+
+    Buffer truncated = saved;
+
+    truncated.length = length;
+
+    CHECK(! seq.deserialize(bufferRead, &truncated));
+
+  }
+
+  // the whole stream doesn't fit in the free slots either
+  saved.position = 0;
+  CHECK(! seq.deserialize(bufferRead, &saved));
+
+  seq.serialize(bufferWrite, &after);
+
+  CHECK(seq.getUsedSlots() == 60);
+  CHECK(sameDump(before, after));
+
+}
+
+// a load that fits in the free slots replaces the sequence
+void testLoad() {
+
+  FifteenStep source(256);
+  FifteenStep seq(256);
+  Buffer saved = {{0}, 0, 0};
+  Buffer loaded = {{0}, 0, 0};
+
+  source.setClockSource(now);
+  source.begin(90, 16);
+  fill(source, 40, 20);
+  source.serialize(bufferWrite, &saved);
+
+  seq.setClockSource(now);
+  seq.begin(140, 16);
+  fill(seq, 60, 30);
+
+  CHECK(seq.deserialize(bufferRead, &saved));
+
+  seq.serialize(bufferWrite, &loaded);
+
+  CHECK(seq.getUsedSlots() == 20);
+  CHECK(sameDump(saved, loaded));
+
+}
+
+// a SysEx dump is checked in memory, so it can replace a full sequence
+void testSysExOverFullSequence() {
+
+  FifteenStep source(256);
+  FifteenStep seq(256);
+  Buffer dump = {{0}, 0, 0};
+  Buffer saved = {{0}, 0, 0};
+  Buffer loaded = {{0}, 0, 0};
+
+  source.setClockSource(now);
+  source.begin(90, 16);
+  fill(source, 40, 40);
+  source.setSysExHandler(sysexWrite, &dump);
+  source.sendDump();
+  source.serialize(bufferWrite, &saved);
+
+  seq.setClockSource(now);
+  seq.begin(140, 16);
+  fill(seq, 60, 60);
+  seq.stop();
+
+  // pass the messages in one at a time
+  for(int start = 0, end = 0; end < dump.length; ++end)
+  {
+
+    if(dump.data[end] != 0xF7)
+      continue;
+
+    CHECK(seq.receiveSysEx(dump.data + start, end - start + 1));
+    start = end + 1;
+
+  }
+
+  seq.serialize(bufferWrite, &loaded);
+
+  CHECK(sameDump(saved, loaded));
+
+}
+
+int main() {
+
+  testTruncatedLoad();
+  testLoad();
+  testSysExOverFullSequence();
+
+  return failures > 0 ? 1 : 0;
+
+}
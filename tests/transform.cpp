@@ -0,0 +1,91 @@
+// ---------------------------------------------------------------------------
+//
+// transform.cpp
+// Host tests for the pattern transforms.
+//
+// Author: Todd Treece <todd@uniontownlabs.org>
+// Copyright: (c) 2015 Adafruit Industries
+// License: GNU GPLv3
+//
+// ---------------------------------------------------------------------------
+#include "FifteenStep.h"
+#include "FifteenStepSimulator.h"
+#include "check.h"
+
+// note offs sent for each pitch
+int offs[128];
+
+void event(void*, const FifteenStepEvent &e) {
+  if(e.command == 0x8)
+    offs[e.arg1]++;
+}
+
+// finds a note in the whole sequence
+bool hasNote(FifteenStep &seq, byte pitch, byte velocity, byte step) {
+
+  FifteenStepNote* notes = seq.getSequence();
+
+  for(int i = 0; i < seq.getCapacity(); ++i)
+  {
+    if(notes[i].pitch == pitch && notes[i].velocity == velocity && notes[i].step == step)
+      return true;
+  }
+
+  return false;
+
+}
+
+// a transform at the end of the loop changes the pattern that
+// just played, and not the next pattern in the song
+void testSongTransform() {
+
+  FifteenStep seq(256);
+  FifteenStepSimulator sim = FifteenStepSimulator(seq);
+  FifteenStepSongEntry song[] = {{0, 1}, {1, 1}};
+
+  seq.begin(120, 16);
+  sim.setEventHandler(event);
+
+  // pattern 0 holds a note over the end of the loop
+  seq.setPattern(0);
+  seq.setNote(0, 60, 100, 14);
+  seq.setNote(0, 60, 0, 2);
+
+  seq.setPattern(1);
+  seq.setNote(0, 70, 100, 4);
+  seq.setNote(0, 70, 0, 6);
+
+  seq.setSong(song, 2);
+
+  // the note on has played, and the loop hasn't ended
+  while(seq.getPattern() == 0 && seq.getPosition() < 15)
+    sim.advance(10);
+
+  CHECK(seq.getPattern() == 0);
+  CHECK(seq.transpose(2, FS_ANY_CHANNEL, true));
+  CHECK(hasNote(seq, 60, 100, 14));
+
+  for(int i = 0; i < 128; ++i)
+    offs[i] = 0;
+
+  while(seq.getPattern() == 0)
+    sim.advance(10);
+
+  CHECK(hasNote(seq, 62, 100, 14));
+  CHECK(hasNote(seq, 62, 0, 2));
+  CHECK(hasNote(seq, 70, 100, 16 + 4));
+  CHECK(hasNote(seq, 70, 0, 16 + 6));
+
+  // the held note was turned off before it moved
+  CHECK(offs[60] == 1);
+  CHECK(offs[70] == 0);
+
+}
+
+int main() {
+
+  testSongTransform();
+
+  return failures > 0 ? 1 : 0;
+
+}